@@ -0,0 +1,140 @@
+#include "bc1.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// BC1 block compression
+///////////////////////////////////////////////////////////////////////////////
+// Every 4x4 block stores two RGB565 end colors and picks one of four colors
+// per texel: the two ends and two points a third of the way between them.
+// That is 4 bits per texel against 32 for RGBA32, at the price of blocky
+// gradients and no alpha. The encoder is the usual fast one: the end colors
+// are the corners of the block's color bounding box, pulled in by 1/16th of
+// its size, and each texel takes the nearest palette color.
+///////////////////////////////////////////////////////////////////////////////
+
+static int texel_red(uint32_t texel) { return texel & 0xFF; }
+static int texel_green(uint32_t texel) { return (texel >> 8) & 0xFF; }
+static int texel_blue(uint32_t texel) { return (texel >> 16) & 0xFF; }
+
+static uint32_t pack_texel(int red, int green, int blue, int alpha) {
+    return (uint32_t)red | ((uint32_t)green << 8) | ((uint32_t)blue << 16) | ((uint32_t)alpha << 24);
+}
+
+static uint16_t pack_rgb565(int red, int green, int blue) {
+    return (uint16_t)(((red * 31 + 127) / 255) << 11 | ((green * 63 + 127) / 255) << 5 | ((blue * 31 + 127) / 255));
+}
+
+// Widen to 8 bits per channel by repeating the top bits
+static uint32_t unpack_rgb565(uint16_t color) {
+    int red = (color >> 11) & 0x1F;
+    int green = (color >> 5) & 0x3F;
+    int blue = color & 0x1F;
+    return pack_texel((red << 3) | (red >> 2), (green << 2) | (green >> 4), (blue << 3) | (blue >> 2), 0xFF);
+}
+
+// Channel-wise (2 * a + b) / 3
+static uint32_t blend_third(uint32_t a, uint32_t b) {
+    return pack_texel(
+        (2 * texel_red(a) + texel_red(b)) / 3,
+        (2 * texel_green(a) + texel_green(b)) / 3,
+        (2 * texel_blue(a) + texel_blue(b)) / 3,
+        0xFF
+    );
+}
+
+// Channel-wise (a + b) / 2
+static uint32_t blend_half(uint32_t a, uint32_t b) {
+    return pack_texel(
+        (texel_red(a) + texel_red(b)) / 2,
+        (texel_green(a) + texel_green(b)) / 2,
+        (texel_blue(a) + texel_blue(b)) / 2,
+        0xFF
+    );
+}
+
+// Palette color index of the block. Color 0 above color 1 selects the four
+// color mode, the only one the encoder writes; otherwise the third color is
+// the midpoint and the fourth is transparent black.
+static uint32_t decode_bc1_color(const uint32_t* block, int index) {
+    uint16_t color_0 = block[0] & 0xFFFF;
+    uint16_t color_1 = block[0] >> 16;
+    switch (index) {
+        case 0: return unpack_rgb565(color_0);
+        case 1: return unpack_rgb565(color_1);
+        case 2:
+            if (color_0 > color_1) return blend_third(unpack_rgb565(color_0), unpack_rgb565(color_1));
+            return blend_half(unpack_rgb565(color_0), unpack_rgb565(color_1));
+        default:
+            if (color_0 > color_1) return blend_third(unpack_rgb565(color_1), unpack_rgb565(color_0));
+            return 0;
+    }
+}
+
+// The four colors a block can pick from
+void decode_bc1_palette(const uint32_t* block, uint32_t palette[4]) {
+    uint16_t color_0 = block[0] & 0xFFFF;
+    uint16_t color_1 = block[0] >> 16;
+    palette[0] = unpack_rgb565(color_0);
+    palette[1] = unpack_rgb565(color_1);
+    if (color_0 > color_1) {
+        palette[2] = blend_third(palette[0], palette[1]);
+        palette[3] = blend_third(palette[1], palette[0]);
+    } else {
+        palette[2] = blend_half(palette[0], palette[1]);
+        palette[3] = 0;
+    }
+}
+
+// Texel (x, y) of the block alone, without building the whole palette
+uint32_t decode_bc1_texel_in_block(const uint32_t* block, int x, int y) {
+    return decode_bc1_color(block, bc1_texel_index(block, x, y));
+}
+
+void encode_bc1_block(const uint32_t texels[16], uint32_t* block) {
+    int min[3] = { 255, 255, 255 };
+    int max[3] = { 0, 0, 0 };
+    for (int i = 0; i < 16; i++) {
+        int channels[3] = { texel_red(texels[i]), texel_green(texels[i]), texel_blue(texels[i]) };
+        for (int c = 0; c < 3; c++) {
+            if (channels[c] < min[c]) min[c] = channels[c];
+            if (channels[c] > max[c]) max[c] = channels[c];
+        }
+    }
+    // Insetting the box trades the extremes for a better fit of the bulk
+    for (int c = 0; c < 3; c++) {
+        int inset = (max[c] - min[c]) >> 4;
+        min[c] += inset;
+        max[c] -= inset;
+    }
+
+    uint16_t color_0 = pack_rgb565(max[0], max[1], max[2]);
+    uint16_t color_1 = pack_rgb565(min[0], min[1], min[2]);
+    if (color_0 < color_1) {
+        uint16_t swap = color_0;
+        color_0 = color_1;
+        color_1 = swap;
+    }
+    block[0] = color_0 | ((uint32_t)color_1 << 16);
+    block[1] = 0;
+    if (color_0 == color_1) {
+        // Flat block: every index 0 picks color 0
+        return;
+    }
+
+    uint32_t palette[4];
+    decode_bc1_palette(block, palette);
+    for (int i = 0; i < 16; i++) {
+        int best_index = 0;
+        int best_distance = 1 << 30;
+        for (int p = 0; p < 4; p++) {
+            int dr = texel_red(texels[i]) - texel_red(palette[p]);
+            int dg = texel_green(texels[i]) - texel_green(palette[p]);
+            int db = texel_blue(texels[i]) - texel_blue(palette[p]);
+            int distance = dr * dr + dg * dg + db * db;
+            if (distance < best_distance) {
+                best_distance = distance;
+                best_index = p;
+            }
+        }
+        block[1] |= (uint32_t)best_index << (2 * i);
+    }
+}
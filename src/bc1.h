@@ -0,0 +1,20 @@
+#ifndef BC1_H
+#define BC1_H
+
+#include <stdint.h>
+
+// A BC1 (DXT1) block holds 4x4 texels in 64 bits, as two 32-bit words: the
+// two RGB565 end colors (color 0 in the low half), then a 2-bit palette
+// index per texel, row-major from the least significant bits
+#define BC1_BLOCK_WORDS 2
+
+void encode_bc1_block(const uint32_t texels[16], uint32_t* block);
+void decode_bc1_palette(const uint32_t* block, uint32_t palette[4]);
+uint32_t decode_bc1_texel_in_block(const uint32_t* block, int x, int y);
+
+// Palette index of texel (x, y) of the block, coordinates taken modulo 4
+static inline int bc1_texel_index(const uint32_t* block, int x, int y) {
+    return (block[1] >> (2 * (((y & 3) << 2) + (x & 3)))) & 3;
+}
+
+#endif
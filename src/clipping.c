@@ -1,9 +1,19 @@
 #include <math.h>
 #include "clipping.h"
+#include "stats.h"
 
 #define NUM_PLANES 6
 plane_t frustum_planes[NUM_PLANES];
 
+// The guard band reaches this many half-screens out from the screen center
+#define GUARD_BAND_SCALE 4.0
+
+// Left, right, top and bottom planes of the widened guard band frustum
+#define NUM_GUARD_BAND_PLANES 4
+plane_t guard_band_planes[NUM_GUARD_BAND_PLANES];
+
+static bool guard_band_clipping = true;
+
 ///////////////////////////////////////////////////////////////////////////////
 // Frustum planes are defined by a point and a normal vector
 ///////////////////////////////////////////////////////////////////////////////
@@ -62,6 +72,25 @@ void init_frustum_planes(float fovx, float fovy, float z_near, float z_far) {
 	frustum_planes[FAR_FRUSTUM_PLANE].normal.x = 0;
 	frustum_planes[FAR_FRUSTUM_PLANE].normal.y = 0;
 	frustum_planes[FAR_FRUSTUM_PLANE].normal.z = -1;
+
+	// Same side planes with the tangent of the half field of view scaled up
+	float half_guard_fovx = atan(GUARD_BAND_SCALE * tan(fovx / 2));
+	float half_guard_fovy = atan(GUARD_BAND_SCALE * tan(fovy / 2));
+	for (int plane = LEFT_FRUSTUM_PLANE; plane <= BOTTOM_FRUSTUM_PLANE; plane++) {
+		guard_band_planes[plane].point = vec3_new(0, 0, 0);
+	}
+	guard_band_planes[LEFT_FRUSTUM_PLANE].normal = vec3_new(cos(half_guard_fovx), 0, sin(half_guard_fovx));
+	guard_band_planes[RIGHT_FRUSTUM_PLANE].normal = vec3_new(-cos(half_guard_fovx), 0, sin(half_guard_fovx));
+	guard_band_planes[TOP_FRUSTUM_PLANE].normal = vec3_new(0, -cos(half_guard_fovy), sin(half_guard_fovy));
+	guard_band_planes[BOTTOM_FRUSTUM_PLANE].normal = vec3_new(0, cos(half_guard_fovy), sin(half_guard_fovy));
+}
+
+void set_guard_band_clipping(bool enabled) {
+    guard_band_clipping = enabled;
+}
+
+bool is_guard_band_clipping(void) {
+    return guard_band_clipping;
 }
 
 
@@ -155,7 +184,7 @@ void clip_polygon_against_plane(polygon_t* polygon, int plane){
 
 }
 
-void clip_polygon(polygon_t* polygon){
+static void clip_polygon_against_all_planes(polygon_t* polygon){
     clip_polygon_against_plane(polygon, LEFT_FRUSTUM_PLANE);
     clip_polygon_against_plane(polygon, RIGHT_FRUSTUM_PLANE);
     clip_polygon_against_plane(polygon, TOP_FRUSTUM_PLANE);
@@ -164,6 +193,129 @@ void clip_polygon(polygon_t* polygon){
     clip_polygon_against_plane(polygon, FAR_FRUSTUM_PLANE);
 }
 
+// Bit mask of the planes the vertex is outside of (bit i set for plane i)
+static int plane_outcode(vec3_t vertex, plane_t* planes, int num_planes){
+    int outcode = 0;
+    for (int plane = 0; plane < num_planes; plane++) {
+        if (vec3_dot(vec3_sub(vertex, planes[plane].point), planes[plane].normal) <= 0) {
+            outcode |= 1 << plane;
+        }
+    }
+    return outcode;
+}
+
+// Frustum planes then guard band planes, in outcode bit order
+void get_clip_planes(plane_t planes[NUM_CLIP_PLANES]){
+    for (int plane = 0; plane < NUM_PLANES; plane++) {
+        planes[plane] = frustum_planes[plane];
+    }
+    for (int plane = 0; plane < NUM_GUARD_BAND_PLANES; plane++) {
+        planes[GUARD_BAND_OUTCODE_SHIFT + plane] = guard_band_planes[plane];
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Bounding volumes against the frustum
+///////////////////////////////////////////////////////////////////////////////
+// Whole meshes are tested in camera space before any per-face work. Inside
+// must hold with a small margin: the faces of an inside mesh skip clipping,
+// which would otherwise still cut a vertex that rounds onto a plane.
+///////////////////////////////////////////////////////////////////////////////
+#define BOUNDS_MARGIN 1e-3f
+
+int classify_sphere_in_frustum(vec3_t center, float radius){
+    int result = BOUNDS_INSIDE;
+    for (int plane = 0; plane < NUM_PLANES; plane++) {
+        float distance = vec3_dot(vec3_sub(center, frustum_planes[plane].point), frustum_planes[plane].normal);
+        if (distance < -radius - BOUNDS_MARGIN) {
+            return BOUNDS_OUTSIDE;
+        }
+        if (distance <= radius + BOUNDS_MARGIN) {
+            result = BOUNDS_INTERSECTING;
+        }
+    }
+    return result;
+}
+
+// Classify the convex hull of the points, e.g. the corners of a box
+int classify_points_in_frustum(const vec3_t* points, int num_points){
+    int result = BOUNDS_INSIDE;
+    for (int plane = 0; plane < NUM_PLANES; plane++) {
+        int num_outside = 0;
+        for (int i = 0; i < num_points; i++) {
+            float distance = vec3_dot(vec3_sub(points[i], frustum_planes[plane].point), frustum_planes[plane].normal);
+            if (distance < -BOUNDS_MARGIN) {
+                num_outside++;
+            } else if (distance <= BOUNDS_MARGIN) {
+                result = BOUNDS_INTERSECTING;
+            }
+        }
+        if (num_outside == num_points) {
+            return BOUNDS_OUTSIDE;
+        }
+        if (num_outside > 0) {
+            result = BOUNDS_INTERSECTING;
+        }
+    }
+    return result;
+}
+
+int vertex_outcode(vec3_t vertex){
+    return plane_outcode(vertex, frustum_planes, NUM_PLANES) |
+           plane_outcode(vertex, guard_band_planes, NUM_GUARD_BAND_PLANES) << GUARD_BAND_OUTCODE_SHIFT;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Guard-band clipping
+///////////////////////////////////////////////////////////////////////////////
+// The rasterizer scissors every triangle to the viewport (or its tile), so
+// the side planes only need geometric clipping to keep screen coordinates in
+// a range the fixed-point rasterizer handles. A triangle whose vertices are
+// all inside a guard band GUARD_BAND_SCALE times wider than the screen is
+// left unclipped on the sides; only a near or far plane crossing is still
+// clipped geometrically, because the perspective divide needs w > 0.
+// Triangles completely outside one frustum plane are dropped outright, and
+// only triangles that leave the guard band go through all six planes.
+///////////////////////////////////////////////////////////////////////////////
+void clip_polygon(polygon_t* polygon){
+    int outcodes[3];
+    for (int i = 0; i < 3; i++) {
+        outcodes[i] = guard_band_clipping ? vertex_outcode(polygon->vertices[i]) : 0;
+    }
+    add_stat(clip_polygon_outcodes(polygon, outcodes), 1);
+}
+
+// Same as clip_polygon() with the outcodes of the three triangle vertices
+// already known, e.g. from the batched vertex transform. Instead of counting
+// the case taken, returns its STAT_CLIP_* counter, so that threads clipping
+// many polygons can add the counts up once.
+int clip_polygon_outcodes(polygon_t* polygon, const int outcodes[3]){
+    if (!guard_band_clipping) {
+        clip_polygon_against_all_planes(polygon);
+        return STAT_CLIP_FULL;
+    }
+
+    // All vertices outside the same plane: nothing of the triangle is visible
+    if (outcodes[0] & outcodes[1] & outcodes[2] & FRUSTUM_OUTCODE_MASK) {
+        polygon->num_vertices = 0;
+        return STAT_CLIP_REJECTED;
+    }
+
+    // Leaves the guard band: clip against all the frustum planes
+    int crossed = outcodes[0] | outcodes[1] | outcodes[2];
+    if (crossed >> GUARD_BAND_OUTCODE_SHIFT) {
+        clip_polygon_against_all_planes(polygon);
+        return STAT_CLIP_FULL;
+    }
+
+    // Inside the guard band: only clip planes that cut through w
+    if (crossed & ((1 << NEAR_FRUSTUM_PLANE) | (1 << FAR_FRUSTUM_PLANE))) {
+        if (crossed & (1 << NEAR_FRUSTUM_PLANE)) clip_polygon_against_plane(polygon, NEAR_FRUSTUM_PLANE);
+        if (crossed & (1 << FAR_FRUSTUM_PLANE)) clip_polygon_against_plane(polygon, FAR_FRUSTUM_PLANE);
+        return STAT_CLIP_DEPTH_ONLY;
+    }
+    return STAT_CLIP_GUARD_BAND_ACCEPTED;
+}
 
 void triangles_from_polygon(polygon_t* polygon, triangle_t triangles[], int *num_triangles){
     for( int i = 0; i < polygon->num_vertices - 2; i++ ){
@@ -1,6 +1,7 @@
 #ifndef CLIPPING_H
 #define CLIPPING_H
 
+#include <stdbool.h>
 #include "triangle.h"
 #include "vector.h"
 
@@ -21,6 +22,19 @@ typedef struct {
     vec3_t normal;
 } plane_t;
 
+// A vertex outcode has one bit per plane the vertex is outside of: the six
+// frustum planes, then the left, right, top and bottom guard band planes
+#define NUM_CLIP_PLANES 10
+#define GUARD_BAND_OUTCODE_SHIFT 6
+#define FRUSTUM_OUTCODE_MASK ((1 << GUARD_BAND_OUTCODE_SHIFT) - 1)
+
+// Where a bounding volume lies against the view frustum
+enum {
+    BOUNDS_OUTSIDE,
+    BOUNDS_INTERSECTING,
+    BOUNDS_INSIDE
+};
+
 typedef struct{
     vec3_t vertices[MAX_NUM_POLY_VERTICES];
     tex2_t texcoords[MAX_NUM_POLY_VERTICES];
@@ -32,6 +46,15 @@ void init_frustum_planes(float fovx, float fovy, float z_near, float z_far);
 polygon_t polygon_from_triangle(vec3_t v0, vec3_t v1, vec3_t v2, tex2_t t0, tex2_t t1, tex2_t t2);
 void triangles_from_polygon(polygon_t* polygon, triangle_t triangles[], int *num_triangles);
 void clip_polygon(polygon_t* polygon);
+int clip_polygon_outcodes(polygon_t* polygon, const int outcodes[3]);
+
+void get_clip_planes(plane_t planes[NUM_CLIP_PLANES]);
+int classify_sphere_in_frustum(vec3_t center, float radius);
+int classify_points_in_frustum(const vec3_t* points, int num_points);
+int vertex_outcode(vec3_t vertex);
+
+void set_guard_band_clipping(bool enabled);
+bool is_guard_band_clipping(void);
 
 
 #endif
\ No newline at end of file
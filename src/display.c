@@ -5,6 +5,13 @@ static SDL_Renderer* renderer = NULL;
 static uint32_t* color_buffer = NULL;
 static float* z_buffer = NULL;
 
+// Coarse depth pyramid level: farthest depth stored in every 8x8 z-buffer block
+static float* hiz_buffer = NULL;
+static bool* hiz_dirty = NULL;
+static int hiz_width = 0;
+static int hiz_height = 0;
+static bool hiz_enabled = true;
+
 static SDL_Texture* color_buffer_texture = NULL;
 static int window_width = 800;
 static int window_height = 600;
@@ -20,6 +27,11 @@ int get_window_height(void) {
     return window_height;
 }
 
+rect_t get_viewport_rect(void) {
+    rect_t viewport = { 0, 0, window_width, window_height };
+    return viewport;
+}
+
 bool initialize_window(void) {
     
     if (SDL_Init(SDL_INIT_EVERYTHING) != 0) {
@@ -64,6 +76,11 @@ bool initialize_window(void) {
     color_buffer = (uint32_t*) malloc(sizeof(uint32_t) * window_width * window_height);
     z_buffer = (float*) malloc(sizeof(float) * window_width * window_height);
 
+    hiz_width = (window_width + HIZ_BLOCK_SIZE - 1) / HIZ_BLOCK_SIZE;
+    hiz_height = (window_height + HIZ_BLOCK_SIZE - 1) / HIZ_BLOCK_SIZE;
+    hiz_buffer = (float*) malloc(sizeof(float) * hiz_width * hiz_height);
+    hiz_dirty = (bool*) malloc(sizeof(bool) * hiz_width * hiz_height);
+
     // Creating a SDL texture that is used to display the color buffer
     color_buffer_texture = SDL_CreateTexture(
         renderer,
@@ -93,7 +110,11 @@ bool should_render_filled_triangles(void) {
 }
 
 bool should_render_textured_triangles(void){
-    return (render_method == RENDER_TEXTURED || render_method == RENDER_TEXTURED_WIRE);
+    return (render_method == RENDER_TEXTURED || render_method == RENDER_TEXTURED_WIRE || render_method == RENDER_TEXTURED_AFFINE);
+}
+
+bool should_render_affine_textures(void){
+    return render_method == RENDER_TEXTURED_AFFINE;
 }
 
 bool should_render_wireframe(void){
@@ -129,21 +150,75 @@ void draw_pixel(int x, int y, uint32_t color) {
     color_buffer[(window_width * y) + x] = color;
 }
 
+///////////////////////////////////////////////////////////////////////////////
+// Clipped integer Bresenham line
+///////////////////////////////////////////////////////////////////////////////
+// The line is walked along its major axis, one pixel per step i in [0, n].
+// The minor axis offset of step i is round(i * minor / major), tracked with
+// an integer error term instead of floats:
+//
+//     offset(i) = (2 * i * minor + major) / (2 * major)
+//
+// Before drawing, the step range is clipped (Liang-Barsky style, but on the
+// integer step index) to the steps whose pixel is on screen on both axes.
+// The error term is then started directly at the first visible step, so the
+// pixels drawn are exactly those of the unclipped line, without visiting
+// the off-screen part or bounds checking any pixel.
+///////////////////////////////////////////////////////////////////////////////
 void draw_line(int x0, int y0, int x1, int y1, uint32_t color){
-    int delta_x = (x1 - x0);
-    int delta_y = (y1 - y0);
-
-    int longest_side_length = (abs(delta_x) >= abs(delta_y) ? abs(delta_x) : abs(delta_y));
-
-    float x_inc = delta_x / (float)longest_side_length;
-    float y_inc = delta_y / (float)longest_side_length;
+    bool x_major = abs(x1 - x0) >= abs(y1 - y0);
+    int64_t major_length = x_major ? abs(x1 - x0) : abs(y1 - y0);
+    int64_t minor_length = x_major ? abs(y1 - y0) : abs(x1 - x0);
+    int major_start = x_major ? x0 : y0;
+    int minor_start = x_major ? y0 : x0;
+    int major_step = (x_major ? x1 - x0 : y1 - y0) >= 0 ? 1 : -1;
+    int minor_step = (x_major ? y1 - y0 : x1 - x0) >= 0 ? 1 : -1;
+    int major_size = x_major ? window_width : window_height;
+    int minor_size = x_major ? window_height : window_width;
+
+    // Steps whose major coordinate lies on screen
+    int64_t first = 0;
+    int64_t last = major_length;
+    int64_t major_low = major_step > 0 ? -major_start : major_start - (major_size - 1);
+    int64_t major_high = major_step > 0 ? (major_size - 1) - major_start : major_start;
+    if (major_low > first) first = major_low;
+    if (major_high < last) last = major_high;
+
+    // Steps whose minor offset keeps the minor coordinate on screen
+    int64_t minor_low = minor_step > 0 ? -minor_start : minor_start - (minor_size - 1);
+    int64_t minor_high = minor_step > 0 ? (minor_size - 1) - minor_start : minor_start;
+    if (minor_length == 0) {
+        if (minor_low > 0 || minor_high < 0) return;
+    } else {
+        int64_t minor_first = ceil_div((2 * minor_low - 1) * major_length, 2 * minor_length);
+        int64_t minor_last = ceil_div((2 * minor_high + 1) * major_length, 2 * minor_length) - 1;
+        if (minor_first > first) first = minor_first;
+        if (minor_last < last) last = minor_last;
+    }
+    if (first > last) {
+        return;
+    }
 
-    float current_x = x0;
-    float current_y = y0;
-    for( int i = 0; i <= longest_side_length; i++){
-        draw_pixel(round(current_x), round(current_y), color);
-        current_x += x_inc;
-        current_y += y_inc;
+    // Bresenham state at the first visible step
+    int64_t error_limit = 2 * major_length;
+    int64_t numerator = 2 * first * minor_length + major_length;
+    int64_t minor_offset = major_length ? numerator / error_limit : 0;
+    int64_t error = major_length ? numerator % error_limit : 0;
+
+    int major = major_start + major_step * (int)first;
+    int minor = minor_start + minor_step * (int)minor_offset;
+    int index = x_major ? (window_width * minor) + major : (window_width * major) + minor;
+    int major_stride = x_major ? major_step : major_step * window_width;
+    int minor_stride = x_major ? minor_step * window_width : minor_step;
+
+    for (int64_t i = first; i <= last; i++) {
+        color_buffer[index] = color;
+        index += major_stride;
+        error += 2 * minor_length;
+        if (error >= error_limit) {
+            error -= error_limit;
+            index += minor_stride;
+        }
     }
 }
 
@@ -154,14 +229,28 @@ void draw_line(int x0, int y0, int x1, int y1, uint32_t color){
 // }
 
 void draw_rect(int x, int y, int width, int height, uint32_t color){
-    for( int i = x; i < x + width; i++){
-        for(int j = y; j < y + height; j++){
-            draw_pixel(i, j, color);
-            // color_buffer[j * window_width + i] = color;
+    // Clip the rectangle to the viewport once instead of testing every pixel
+    int x_min = x < 0 ? 0 : x;
+    int y_min = y < 0 ? 0 : y;
+    int x_max = x + width > window_width ? window_width : x + width;
+    int y_max = y + height > window_height ? window_height : y + height;
+
+    for (int j = y_min; j < y_max; j++) {
+        uint32_t* row = color_buffer + (window_width * j);
+        for (int i = x_min; i < x_max; i++) {
+            row[i] = color;
         }
     }
 }
 
+uint32_t* get_color_buffer(void){
+    return color_buffer;
+}
+
+float* get_z_buffer(void){
+    return z_buffer;
+}
+
 void render_color_buffer(void){
     // Puts color_buffer to the color_buffer_texture
     SDL_UpdateTexture(
@@ -184,6 +273,64 @@ void clear_z_buffer() {
     for (int i = 0; i < window_width * window_height; i++){
         z_buffer[i] = 1.0;
     } 
+    // Every block is now empty, so its farthest depth is the far plane again
+    for (int i = 0; i < hiz_width * hiz_height; i++){
+        hiz_buffer[i] = 1.0;
+        hiz_dirty[i] = false;
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Hierarchical Z-buffer
+///////////////////////////////////////////////////////////////////////////////
+// Depth writes only ever bring z-buffer values closer, so the stored maximum
+// of a block stays a safe (conservative) bound after any write. Blocks that
+// were written to are flagged dirty and their maximum is tightened lazily,
+// once per triangle, when the rasterizer tests the triangle against them.
+// HIZ_BLOCK_SIZE divides TILE_SIZE, so a block is only ever touched by the
+// thread that owns its tile.
+///////////////////////////////////////////////////////////////////////////////
+void set_hiz_enabled(bool enabled){
+    hiz_enabled = enabled;
+}
+
+bool is_hiz_enabled(void){
+    return hiz_enabled;
+}
+
+// Conservative farthest depth of a block, without tightening it
+float get_hiz_max_depth(int block_x, int block_y){
+    return hiz_buffer[(hiz_width * block_y) + block_x];
+}
+
+// Recompute the farthest depth of a block if it was written since last time
+float update_hiz_block(int block_x, int block_y){
+    int block = (hiz_width * block_y) + block_x;
+    if (hiz_dirty[block]) {
+        int x_start = block_x * HIZ_BLOCK_SIZE;
+        int y_start = block_y * HIZ_BLOCK_SIZE;
+        int x_end = x_start + HIZ_BLOCK_SIZE < window_width ? x_start + HIZ_BLOCK_SIZE : window_width;
+        int y_end = y_start + HIZ_BLOCK_SIZE < window_height ? y_start + HIZ_BLOCK_SIZE : window_height;
+
+        float max_depth = 0.0;
+        for (int y = y_start; y < y_end; y++) {
+            for (int x = x_start; x < x_end; x++) {
+                float depth = z_buffer[(window_width * y) + x];
+                if (depth > max_depth) max_depth = depth;
+            }
+        }
+        hiz_buffer[block] = max_depth;
+        hiz_dirty[block] = false;
+    }
+    return hiz_buffer[block];
+}
+
+// Flag the blocks under a span of the row y whose depth may have changed
+void mark_hiz_dirty(int y, int x_start, int x_end){
+    bool* row = hiz_dirty + (hiz_width * (y / HIZ_BLOCK_SIZE));
+    for (int block_x = x_start / HIZ_BLOCK_SIZE; block_x <= (x_end - 1) / HIZ_BLOCK_SIZE; block_x++) {
+        row[block_x] = true;
+    }
 }
 
 float get_zbuffer_at(int x, int y){
@@ -203,6 +350,8 @@ void update_zbuffer_at(int x, int y, float value){
 void destroy_window(void) {
     free(color_buffer);
     free(z_buffer);
+    free(hiz_buffer);
+    free(hiz_dirty);
     SDL_DestroyRenderer(renderer);
     SDL_DestroyWindow(window); 
     SDL_Quit();
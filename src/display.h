@@ -8,6 +8,8 @@
 #define FPS 60
 #define FRAME_TARGET_TIME (1000 / FPS)
 
+#define HIZ_BLOCK_SIZE 8
+
 enum cull_method{
     CULL_NONE,
     CULL_BACKFACE
@@ -19,13 +21,33 @@ enum render_method{
     RENDER_FILL_TRIANGLE,
     RENDER_FILL_TRIANGLE_WIRE,
     RENDER_TEXTURED,
-    RENDER_TEXTURED_WIRE
+    RENDER_TEXTURED_WIRE,
+    RENDER_TEXTURED_AFFINE
 } ;
 
+// Screen rectangle with inclusive min and exclusive max bounds
+typedef struct {
+    int x_min;
+    int y_min;
+    int x_max;
+    int y_max;
+} rect_t;
+
+// Integer division rounding toward -infinity / +infinity (divisor > 0)
+static inline int64_t floor_div(int64_t numerator, int64_t divisor) {
+    int64_t quotient = numerator / divisor;
+    return (numerator % divisor != 0 && numerator < 0) ? quotient - 1 : quotient;
+}
+
+static inline int64_t ceil_div(int64_t numerator, int64_t divisor) {
+    int64_t quotient = numerator / divisor;
+    return (numerator % divisor != 0 && numerator > 0) ? quotient + 1 : quotient;
+}
 
 bool initialize_window(void);
 int get_window_width(void);
 int get_window_height(void);
+rect_t get_viewport_rect(void);
 
 void set_render_method(int method);
 void set_cull_method(int method);
@@ -33,6 +55,7 @@ bool should_cull_backface(void);
 
 bool should_render_filled_triangles(void);
 bool should_render_textured_triangles(void);
+bool should_render_affine_textures(void);
 bool should_render_wireframe(void);
 bool should_render_wire_vertex(void);
 
@@ -41,12 +64,22 @@ void draw_pixel(int x, int y, uint32_t color);
 void draw_line(int x0, int y0, int x1, int y1, uint32_t color);
 void draw_rect(int x, int y, int width, int height, uint32_t color);
 
+uint32_t* get_color_buffer(void);
+float* get_z_buffer(void);
+
 void render_color_buffer(void);
 void clear_color_buffer(uint32_t color);
 void clear_z_buffer(void);
 
 float get_zbuffer_at(int x, int y);
 void update_zbuffer_at(int x, int y, float value);
+
+void set_hiz_enabled(bool enabled);
+bool is_hiz_enabled(void);
+float get_hiz_max_depth(int block_x, int block_y);
+float update_hiz_block(int block_x, int block_y);
+void mark_hiz_dirty(int y, int x_start, int x_end);
+
 void destroy_window(void);
 
 #endif
\ No newline at end of file
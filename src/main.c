@@ -1,6 +1,8 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <string.h>
 #include <SDL2/SDL.h>
 #include "upng.h"
 #include "array.h"
@@ -13,11 +15,35 @@
 #include "mesh.h"
 #include "texture.h"
 #include "triangle.h"
+#include "threadpool.h"
+#include "tile.h"
+#include "span.h"
+#include "transform.h"
+#include "stats.h"
+#include "visibility.h"
+#include "ordering.h"
+#include "virtual_texture.h"
 
 #define MAX_TRIANGLES_PER_MESH 200000
-triangle_t triangles_to_render[MAX_TRIANGLES_PER_MESH];
+
+// Two triangle lists. render() draws triangles_to_render, which points at
+// one of them; with frame pipelining the geometry thread fills the other one
+// with the next frame meanwhile.
+triangle_t triangle_lists[2][MAX_TRIANGLES_PER_MESH];
+int num_triangles_in_list[2] = { 0, 0 };
+int render_list = 0;
+triangle_t* triangles_to_render = triangle_lists[0];
 int num_triangles_to_render = 0;
 
+// Frame pipelining state, see the section above update()
+bool frame_pipelining = false;
+bool next_frame_built = false;
+bool geometry_in_flight = false;
+bool geometry_thread_quit = false;
+SDL_Thread* geometry_thread = NULL;
+SDL_sem* geometry_start = NULL;
+SDL_sem* geometry_done = NULL;
+
 // vec3_t cube_rotation = { .x = 0, .y = 0, .z = 0};
 
 bool is_running = false;
@@ -28,6 +54,42 @@ mat4_t world_matrix;
 mat4_t proj_matrix;
 mat4_t view_matrix;
 
+// Camera space vertices of the mesh going through the pipeline and their clip
+// outcodes, reused from mesh to mesh and frame to frame
+vec4_t* camera_vertices = NULL;
+int* camera_outcodes = NULL;
+int camera_vertices_capacity = 0;
+
+// The faces of a mesh go through the geometry stages in chunks of this many,
+// one thread pool job per chunk
+#define GEOMETRY_CHUNK_FACES 512
+
+// Triangles one chunk of faces produced, kept from frame to frame
+typedef struct {
+    triangle_t* triangles;
+    int num_triangles;
+    int capacity;
+} triangle_list_t;
+
+triangle_list_t* geometry_chunks = NULL;
+int geometry_chunks_capacity = 0;
+
+// What the face chunk jobs of a mesh share
+typedef struct {
+    mesh_t* mesh;
+    bool unclipped;     // The whole mesh is inside the frustum
+} face_chunk_job_t;
+
+void benchmark_texture_layouts(void);
+void benchmark_texture_filters(void);
+void benchmark_texture_formats(void);
+void print_mesh_memory(void);
+void init_frame_pipelining(void);
+void set_frame_pipelining(bool enabled);
+bool is_frame_pipelining(void);
+void finish_pipelined_frame(void);
+void free_frame_pipelining(void);
+
 void setup(void) {
     // Initialize render mode and triangle culling method
     // render_method = RENDER_TEXTURED_WIRE;
@@ -36,6 +98,21 @@ void setup(void) {
     set_render_method(RENDER_TEXTURED);
     set_cull_method(CULL_BACKFACE);
 
+    // Spin up one raster worker per CPU core and split the screen in tiles
+    init_thread_pool(SDL_GetCPUCount());
+    init_tiles(get_window_width(), get_window_height());
+    init_visibility_buffer(get_window_width(), get_window_height());
+
+    // Pick the widest SIMD span and vertex transform kernels this CPU supports
+    init_span_kernels();
+    init_vertex_transform();
+
+    // Tile cache and loader thread of the streamed textures
+    init_virtual_texturing(VIRTUAL_CACHE_TILES);
+
+    // Geometry thread that builds the next frame when frames are pipelined
+    init_frame_pipelining();
+
     // Initializa the scene light direction
     init_light(vec3_new(0, 0, 1));
 
@@ -58,6 +135,16 @@ void setup(void) {
     // load_mesh("./assets/efa.obj", "./assets/efa.png", vec3_new(1, 1, 1), vec3_new(-2, -1.3, +9), vec3_new(0, -M_PI/2, 0));
     // load_mesh("./assets/f117.obj", "./assets/efa.png", vec3_new(1, 1, 1), vec3_new(+2, -1.3, +9), vec3_new(0, -M_PI/2, 0));
 
+    // Textures follow the global filter ('b') unless a mesh picks its own:
+    // get_mesh(0)->texture->filter = TEXTURE_FILTER_BILINEAR;
+    // Textures are stored in the format set before loading them, or can be
+    // compressed one by one ('e' compares both):
+    // convert_texture_format(get_mesh(0)->texture, TEXTURE_FORMAT_BC1);
+    // Textures wrap past their edges unless set to clamp:
+    // set_texture_addressing(get_mesh(0)->texture, TEXTURE_ADDRESSING_CLAMP);
+    // Textures too large to keep in memory are streamed in tiles instead:
+    // set_virtual_texturing(true);
+
 }
 
 void process_input(void) {
@@ -97,6 +184,94 @@ void process_input(void) {
                     set_render_method(RENDER_TEXTURED_WIRE);
                     break;
                 }
+                if (event.key.keysym.sym == SDLK_7){
+                    set_render_method(RENDER_TEXTURED_AFFINE);
+                    break;
+                }
+                if (event.key.keysym.sym == SDLK_n){
+                    // Trade texture accuracy for fewer divides: 16 or 8 pixel runs
+                    set_affine_span_length(get_affine_span_length() == 16 ? 8 : 16);
+                    break;
+                }
+                if (event.key.keysym.sym == SDLK_t){
+                    set_tiled_rendering(!is_tiled_rendering());
+                    break;
+                }
+                if (event.key.keysym.sym == SDLK_k){
+                    set_simd_spans(!is_simd_spans());
+                    break;
+                }
+                if (event.key.keysym.sym == SDLK_r){
+                    set_batch_transform(!is_batch_transform());
+                    break;
+                }
+                if (event.key.keysym.sym == SDLK_p){
+                    set_depth_prepass(!is_depth_prepass());
+                    break;
+                }
+                if (event.key.keysym.sym == SDLK_v){
+                    set_visibility_rendering(!is_visibility_rendering());
+                    break;
+                }
+                if (event.key.keysym.sym == SDLK_o){
+                    // Cycle submission, front to back and texture then front to back order
+                    set_triangle_order((get_triangle_order() + 1) % 3);
+                    break;
+                }
+                if (event.key.keysym.sym == SDLK_g){
+                    set_guard_band_clipping(!is_guard_band_clipping());
+                    break;
+                }
+                if (event.key.keysym.sym == SDLK_h){
+                    set_hiz_enabled(!is_hiz_enabled());
+                    break;
+                }
+                if (event.key.keysym.sym == SDLK_m){
+                    set_mipmapping(!is_mipmapping());
+                    break;
+                }
+                if (event.key.keysym.sym == SDLK_b){
+                    set_texture_filter(get_texture_filter() == TEXTURE_FILTER_NEAREST ? TEXTURE_FILTER_BILINEAR : TEXTURE_FILTER_NEAREST);
+                    break;
+                }
+                if (event.key.keysym.sym == SDLK_y){
+                    // Repack every loaded texture in the other memory layout
+                    int layout = (get_texture_layout() + 1) % NUM_TEXTURE_LAYOUTS;
+                    set_texture_layout(layout);
+                    for (int i = 0; i < get_num_meshes(); i++) {
+                        convert_texture_layout(get_mesh(i)->texture, layout);
+                    }
+                    break;
+                }
+                if (event.key.keysym.sym == SDLK_j){
+                    benchmark_texture_layouts();
+                    break;
+                }
+                if (event.key.keysym.sym == SDLK_f){
+                    benchmark_texture_filters();
+                    break;
+                }
+                if (event.key.keysym.sym == SDLK_e){
+                    benchmark_texture_formats();
+                    break;
+                }
+                if (event.key.keysym.sym == SDLK_l){
+                    // Overlap the next frame's geometry with this frame's raster
+                    set_frame_pipelining(!is_frame_pipelining());
+                    break;
+                }
+                if (event.key.keysym.sym == SDLK_z){
+                    print_mesh_memory();
+                    break;
+                }
+                if (event.key.keysym.sym == SDLK_u){
+                    set_micro_triangles(!is_micro_triangles());
+                    break;
+                }
+                if (event.key.keysym.sym == SDLK_i){
+                    set_stats_printing(!is_stats_printing());
+                    break;
+                }
                 if (event.key.keysym.sym == SDLK_c){
                     set_cull_method(CULL_BACKFACE);
                     break;
@@ -137,82 +312,40 @@ void process_input(void) {
     }
 }
 
-///////////////////////////////////////////////////////////////////////////////
-// Process the graphics pipeline stages for all the mesh triangles
-///////////////////////////////////////////////////////////////////////////////
-// +-------------+
-// | Model space |  <-- original mesh vertices
-// +-------------+
-// |   +-------------+
-// `-> | World space |  <-- multiply by world matrix
-//     +-------------+
-//     |   +--------------+
-//     `-> | Camera space |  <-- multiply by view matrix
-//         +--------------+
-//         |    +------------+
-//         `--> |  Clipping  |  <-- clip against the six frustum planes
-//              +------------+
-//              |    +------------+
-//              `--> | Projection |  <-- multiply by projection matrix
-//                   +------------+
-//                   |    +-------------+
-//                   `--> | Image space |  <-- apply perspective divide
-//                        +-------------+
-//                        |    +--------------+
-//                        `--> | Screen space |  <-- ready to render
-//                             +--------------+
-///////////////////////////////////////////////////////////////////////////////
+void push_triangle(triangle_list_t* list, triangle_t triangle){
+    if (list->num_triangles == list->capacity) {
+        list->capacity = list->capacity ? 2 * list->capacity : 256;
+        list->triangles = (triangle_t*)realloc(list->triangles, sizeof(triangle_t) * list->capacity);
+    }
+    list->triangles[list->num_triangles++] = triangle;
+}
 
-void process_graphics_pipeline_stages(mesh_t* mesh){
-    // Create a scale matrix that will be used to multiply the mesh vertices
-    mat4_t scale_matrix = mat4_make_scale(mesh->scale.x, mesh->scale.y, mesh->scale.z);
-    mat4_t translation_matrix = mat4_make_translation(mesh->translation.x , mesh->translation.y, mesh->translation.z);
-    mat4_t rotation_matrix_x = mat4_make_rotation_x(mesh->rotation.x);
-    mat4_t rotation_matrix_y = mat4_make_rotation_y(mesh->rotation.y);
-    mat4_t rotation_matrix_z = mat4_make_rotation_z(mesh->rotation.z);
+// Cull, clip and project one chunk of the faces of the mesh, whose vertices
+// are already in camera_vertices. Runs on any thread of the pool.
+void process_face_chunk_job(int job_index, int thread_index, void* data){
+    (void)thread_index;
+    face_chunk_job_t* job = (face_chunk_job_t*)data;
+    mesh_t* mesh = job->mesh;
+    int first_face = job_index * GEOMETRY_CHUNK_FACES;
+    int end_face = first_face + GEOMETRY_CHUNK_FACES;
+    if (end_face > array_length(mesh->faces)) {
+        end_face = array_length(mesh->faces);
+    }
 
-    // Offset the camera position in the direction where the camera is poiting at
-    vec3_t target = get_camera_lookat_target();
-    vec3_t up_direction = vec3_new(0, 1, 0);
-    view_matrix = mat4_look_at(get_camera_position(), target, up_direction );
+    triangle_list_t* list = &geometry_chunks[job_index];
+    list->num_triangles = 0;
 
-    // Loop all triangle faces of our mesh
-    int num_faces = array_length(mesh->faces);
-    for (int i = 0; i < num_faces; i++){
+    // Counted locally and added once, the counters are shared by all threads
+    int clip_counts[STAT_CLIP_REJECTED + 1] = { 0 };
+
+    // Loop the triangle faces of the chunk
+    for (int i = first_face; i < end_face; i++){
         face_t mesh_face = mesh->faces[i];
-        
-        vec3_t face_vertices[3];
-        face_vertices[0] = mesh->vertices[mesh_face.a - 1];
-        face_vertices[1] = mesh->vertices[mesh_face.b - 1];
-        face_vertices[2] = mesh->vertices[mesh_face.c - 1];
 
         vec4_t transformed_vertices[3];
-
-        // loop  all three vertices of the current face and apply transformations
-        for( int j = 0; j < 3; j++ ){
-            vec4_t transformed_vertex = vec4_from_vec3(face_vertices[j]);
-
-            // Create a World Matrix combining scale, rotation and translation matrices
-            // [L] * [R] * [S] * [Identity ] = [World_matrix]
-
-            world_matrix = mat4_identity();
-            
-            world_matrix = mat4_mul_mat4(scale_matrix, world_matrix);
-            world_matrix = mat4_mul_mat4(rotation_matrix_z, world_matrix);
-            world_matrix = mat4_mul_mat4(rotation_matrix_y, world_matrix);
-            world_matrix = mat4_mul_mat4(rotation_matrix_x, world_matrix);
-            world_matrix = mat4_mul_mat4(translation_matrix, world_matrix);
-
-            // Multiply the world matrix by the original vector
-            transformed_vertex = mat4_mul_vec4(world_matrix, transformed_vertex);
-
-            // Multipy the view matrix by the vector to transform the scene to camera space
-            transformed_vertex = mat4_mul_vec4(view_matrix, transformed_vertex);
-
-            // Save transformed vertex in the array of transformed vertices
-            transformed_vertices[j] = transformed_vertex;
-        }
-
+        transformed_vertices[0] = camera_vertices[mesh_face.a];
+        transformed_vertices[1] = camera_vertices[mesh_face.b];
+        transformed_vertices[2] = camera_vertices[mesh_face.c];
         // Calculate the triangle face normal
         vec3_t face_normal = get_triangle_normal(transformed_vertices);
 
@@ -229,25 +362,40 @@ void process_graphics_pipeline_stages(mesh_t* mesh){
             }
         }
 
-        // Create a polygon from the original transform polygon_from_triangle() -> in
-        polygon_t polygon = polygon_from_triangle(
-            vec3_from_vec4(transformed_vertices[0]),
-            vec3_from_vec4(transformed_vertices[1]),
-            vec3_from_vec4(transformed_vertices[2]),
-            mesh_face.a_uv,
-            mesh_face.b_uv,
-            mesh_face.c_uv
-            
-        );
-
-        // Clip the polygons and return a new polygon with potential new vertices
-        clip_polygon(&polygon);
-
         // Break the clipped polygon apart back into individual triangles
         triangle_t triangles_after_clipping[MAX_NUM_POLY_TRIANGLES];
         int num_triangles_after_clipping = 0;
 
-        triangles_from_polygon(&polygon, triangles_after_clipping, &num_triangles_after_clipping);
+        if (job->unclipped) {
+            // Nothing of the mesh reaches a frustum plane: the face goes on as is
+            for (int j = 0; j < 3; j++) {
+                triangles_after_clipping[0].points[j] = vec4_from_vec3(vec3_from_vec4(transformed_vertices[j]));
+            }
+            triangles_after_clipping[0].texcoords[0] = mesh->texcoords[mesh_face.a];
+            triangles_after_clipping[0].texcoords[1] = mesh->texcoords[mesh_face.b];
+            triangles_after_clipping[0].texcoords[2] = mesh->texcoords[mesh_face.c];
+            num_triangles_after_clipping = 1;
+        } else {
+            // Create a polygon from the original transform polygon_from_triangle() -> in
+            polygon_t polygon = polygon_from_triangle(
+                vec3_from_vec4(transformed_vertices[0]),
+                vec3_from_vec4(transformed_vertices[1]),
+                vec3_from_vec4(transformed_vertices[2]),
+                mesh->texcoords[mesh_face.a],
+                mesh->texcoords[mesh_face.b],
+                mesh->texcoords[mesh_face.c]
+            );
+
+            // Clip the polygons and return a new polygon with potential new vertices
+            int face_outcodes[3] = {
+                camera_outcodes[mesh_face.a],
+                camera_outcodes[mesh_face.b],
+                camera_outcodes[mesh_face.c]
+            };
+            clip_counts[clip_polygon_outcodes(&polygon, face_outcodes)]++;
+
+            triangles_from_polygon(&polygon, triangles_after_clipping, &num_triangles_after_clipping);
+        }
 
         // Loops all the assembled triangles after clipping
         for(int t = 0; t < num_triangles_after_clipping; t++ ){
@@ -285,7 +433,7 @@ void process_graphics_pipeline_stages(mesh_t* mesh){
             float light_intensity_factor = -vec3_dot(face_normal, get_light_direction());
 
             // Calculate the triangle color based on how aligned is the normal and the inverse of the light ray
-            uint32_t triangle_color = light_apply_intensity(mesh_face.color, light_intensity_factor);
+            uint32_t triangle_color = light_apply_intensity(mesh->color, light_intensity_factor);
 
             triangle_t triangle_to_render = {
                 .points = {
@@ -302,13 +450,235 @@ void process_graphics_pipeline_stages(mesh_t* mesh){
                 .texture = mesh->texture
             };
 
-            // Save the projected triangle in the array of triangles to render
-            // triangles_to_render[i] = projected_triangle;
-            if (num_triangles_to_render < MAX_TRIANGLES_PER_MESH){
-                triangles_to_render[num_triangles_to_render++] = triangle_to_render;
+            // Save the projected triangle in the list of the chunk
+            push_triangle(list, triangle_to_render);
+        }
+    }
+
+    for (int counter = STAT_CLIP_GUARD_BAND_ACCEPTED; counter <= STAT_CLIP_REJECTED; counter++) {
+        add_stat(counter, clip_counts[counter]);
+    }
+}
+
+// Where the mesh lies against the frustum: its bounding sphere first, then
+// the corners of its bounding box if the sphere crosses a plane
+int classify_mesh_bounds(mesh_t* mesh, mat4_t world_view_matrix){
+    // The view matrix is rigid, so only the mesh scale changes the radius
+    float scale = fmaxf(fabsf(mesh->scale.x), fmaxf(fabsf(mesh->scale.y), fabsf(mesh->scale.z)));
+    vec3_t center = vec3_from_vec4(mat4_mul_vec4(world_view_matrix, vec4_from_vec3(mesh->bounds_center)));
+    int visibility = classify_sphere_in_frustum(center, mesh->bounds_radius * scale);
+    if (visibility != BOUNDS_INTERSECTING) {
+        return visibility;
+    }
+
+    vec3_t corners[8];
+    for (int i = 0; i < 8; i++) {
+        vec3_t corner = vec3_new(
+            (i & 1) ? mesh->bounds_max.x : mesh->bounds_min.x,
+            (i & 2) ? mesh->bounds_max.y : mesh->bounds_min.y,
+            (i & 4) ? mesh->bounds_max.z : mesh->bounds_min.z
+        );
+        corners[i] = vec3_from_vec4(mat4_mul_vec4(world_view_matrix, vec4_from_vec3(corner)));
+    }
+    return classify_points_in_frustum(corners, 8);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Process the graphics pipeline stages for all the mesh triangles
+///////////////////////////////////////////////////////////////////////////////
+// +-------------+
+// | Model space |  <-- original mesh vertices
+// +-------------+
+// |   +-------------+
+// `-> | World space |  <-- multiply by world matrix
+//     +-------------+
+//     |   +--------------+
+//     `-> | Camera space |  <-- multiply by view matrix
+//         +--------------+
+//         |    +------------+
+//         `--> |  Clipping  |  <-- clip against the six frustum planes
+//              +------------+
+//              |    +------------+
+//              `--> | Projection |  <-- multiply by projection matrix
+//                   +------------+
+//                   |    +-------------+
+//                   `--> | Image space |  <-- apply perspective divide
+//                        +-------------+
+//                        |    +--------------+
+//                        `--> | Screen space |  <-- ready to render
+//                             +--------------+
+///////////////////////////////////////////////////////////////////////////////
+
+void process_graphics_pipeline_stages(mesh_t* mesh, int list, bool parallel){
+    // Create a scale matrix that will be used to multiply the mesh vertices
+    mat4_t scale_matrix = mat4_make_scale(mesh->scale.x, mesh->scale.y, mesh->scale.z);
+    mat4_t translation_matrix = mat4_make_translation(mesh->translation.x , mesh->translation.y, mesh->translation.z);
+    mat4_t rotation_matrix_x = mat4_make_rotation_x(mesh->rotation.x);
+    mat4_t rotation_matrix_y = mat4_make_rotation_y(mesh->rotation.y);
+    mat4_t rotation_matrix_z = mat4_make_rotation_z(mesh->rotation.z);
+
+    // Offset the camera position in the direction where the camera is poiting at
+    vec3_t target = get_camera_lookat_target();
+    vec3_t up_direction = vec3_new(0, 1, 0);
+    view_matrix = mat4_look_at(get_camera_position(), target, up_direction );
+
+    // Create a World Matrix combining scale, rotation and translation matrices
+    // [L] * [R] * [S] * [Identity ] = [World_matrix]
+    world_matrix = mat4_identity();
+    world_matrix = mat4_mul_mat4(scale_matrix, world_matrix);
+    world_matrix = mat4_mul_mat4(rotation_matrix_z, world_matrix);
+    world_matrix = mat4_mul_mat4(rotation_matrix_y, world_matrix);
+    world_matrix = mat4_mul_mat4(rotation_matrix_x, world_matrix);
+    world_matrix = mat4_mul_mat4(translation_matrix, world_matrix);
+
+    // One matrix takes the mesh straight to camera space
+    mat4_t world_view_matrix = mat4_mul_mat4(view_matrix, world_matrix);
+
+    // Whole-mesh frustum test before any per-vertex or per-face work
+    int bounds_visibility = classify_mesh_bounds(mesh, world_view_matrix);
+    if (bounds_visibility == BOUNDS_OUTSIDE) {
+        add_stat(STAT_MESHES_CULLED, 1);
+        return;
+    }
+    face_chunk_job_t job = { .mesh = mesh, .unclipped = bounds_visibility == BOUNDS_INSIDE };
+    add_stat(STAT_MESHES_UNCLIPPED, job.unclipped);
+
+    // Transform every vertex of the mesh once; faces index into the result,
+    // so a vertex shared by several faces is only transformed once
+    const vertex_streams_t* streams = &mesh->vertex_streams;
+    if (streams->padded_count > camera_vertices_capacity) {
+        camera_vertices_capacity = streams->padded_count;
+        camera_vertices = (vec4_t*)realloc(camera_vertices, sizeof(vec4_t) * camera_vertices_capacity);
+        camera_outcodes = (int*)realloc(camera_outcodes, sizeof(int) * camera_vertices_capacity);
+    }
+    // Unclipped meshes need no outcodes
+    if (is_batch_transform()) {
+        // Several vertices per instruction from the x, y and z streams
+        transform_vertex_streams(&world_view_matrix, streams, camera_vertices, job.unclipped ? NULL : camera_outcodes);
+    } else {
+        for (int i = 0; i < streams->count; i++) {
+            vec4_t vertex = { streams->x[i], streams->y[i], streams->z[i], 1 };
+            camera_vertices[i] = mat4_mul_vec4(world_view_matrix, vertex);
+            if (!job.unclipped) {
+                camera_outcodes[i] = vertex_outcode(vec3_from_vec4(camera_vertices[i]));
             }
         }
     }
+
+    // Faces are independent from here on: worker threads take chunks of
+    // them, each writing the triangles it produces to the list of its chunk
+    int num_faces = array_length(mesh->faces);
+    int num_chunks = (num_faces + GEOMETRY_CHUNK_FACES - 1) / GEOMETRY_CHUNK_FACES;
+    if (num_chunks > geometry_chunks_capacity) {
+        geometry_chunks = (triangle_list_t*)realloc(geometry_chunks, sizeof(triangle_list_t) * num_chunks);
+        for (int i = geometry_chunks_capacity; i < num_chunks; i++) {
+            geometry_chunks[i] = (triangle_list_t){ NULL, 0, 0 };
+        }
+        geometry_chunks_capacity = num_chunks;
+    }
+    if (parallel) {
+        run_parallel_jobs(num_chunks, process_face_chunk_job, &job);
+    } else {
+        // The pool is busy rasterizing the current frame
+        for (int i = 0; i < num_chunks; i++) {
+            process_face_chunk_job(i, 0, &job);
+        }
+    }
+
+    // Append the lists in chunk order, so the triangles come out in face
+    // order whichever thread ran which chunk
+    for (int i = 0; i < num_chunks; i++) {
+        triangle_list_t* chunk = &geometry_chunks[i];
+        int count = chunk->num_triangles;
+        if (count > MAX_TRIANGLES_PER_MESH - num_triangles_in_list[list]) {
+            count = MAX_TRIANGLES_PER_MESH - num_triangles_in_list[list];
+        }
+        memcpy(&triangle_lists[list][num_triangles_in_list[list]], chunk->triangles, sizeof(triangle_t) * count);
+        num_triangles_in_list[list] += count;
+    }
+}
+
+void build_triangles(int list, bool parallel);
+void build_triangles_to_render(void);
+
+///////////////////////////////////////////////////////////////////////////////
+// Frame pipelining
+///////////////////////////////////////////////////////////////////////////////
+// Normally update() builds the frame's triangles and render() draws them, one
+// after the other. With frame pipelining on, update() hands the list built
+// during the previous frame to render() and wakes the geometry thread, which
+// builds the next frame into the other list while this one is rasterized.
+// render() waits for it at the end of the frame, so at most one frame is in
+// flight and input, texture streaming and benchmarks always run with no
+// geometry being built. What is drawn lags the input by one frame.
+//
+// The geometry thread works through the face chunks itself, since the thread
+// pool is busy rasterizing. The frame counters reset at the start of a frame
+// while the geometry they then collect belongs to the next one.
+///////////////////////////////////////////////////////////////////////////////
+
+int geometry_thread_loop(void* data){
+    (void)data;
+    while (true) {
+        SDL_SemWait(geometry_start);
+        if (geometry_thread_quit) {
+            break;
+        }
+        build_triangles(1 - render_list, false);
+        SDL_SemPost(geometry_done);
+    }
+    return 0;
+}
+
+void init_frame_pipelining(void){
+    geometry_start = SDL_CreateSemaphore(0);
+    geometry_done = SDL_CreateSemaphore(0);
+    geometry_thread = SDL_CreateThread(geometry_thread_loop, "geometry", NULL);
+    if (!geometry_thread) {
+        fprintf(stderr, "Error creating the geometry thread.\n");
+    }
+}
+
+void set_frame_pipelining(bool enabled){
+    // Whatever was built ahead was built for the other mode
+    frame_pipelining = enabled && geometry_thread != NULL;
+    next_frame_built = false;
+}
+
+bool is_frame_pipelining(void){
+    return frame_pipelining;
+}
+
+// Draw the list built last frame and start building the next one
+void start_pipelined_frame(void){
+    // Nothing was built ahead on the first pipelined frame
+    if (!next_frame_built) {
+        build_triangles(1 - render_list, true);
+    }
+    render_list = 1 - render_list;
+    triangles_to_render = triangle_lists[render_list];
+    num_triangles_to_render = num_triangles_in_list[render_list];
+
+    geometry_in_flight = true;
+    SDL_SemPost(geometry_start);
+}
+
+void finish_pipelined_frame(void){
+    if (geometry_in_flight) {
+        SDL_SemWait(geometry_done);
+        geometry_in_flight = false;
+        next_frame_built = true;
+    }
+}
+
+void free_frame_pipelining(void){
+    if (geometry_thread) {
+        geometry_thread_quit = true;
+        SDL_SemPost(geometry_start);
+        SDL_WaitThread(geometry_thread, NULL);
+    }
+    SDL_DestroySemaphore(geometry_start);
+    SDL_DestroySemaphore(geometry_done);
 }
 
 void update(void){
@@ -325,8 +695,24 @@ void update(void){
 
     previous_frame_time = SDL_GetTicks();
 
+    // A new frame starts here, geometry counters included
+    reset_frame_stats();
+
+    // Stream in the texture tiles the last frame was missing
+    update_virtual_textures();
+
+    if (frame_pipelining) {
+        start_pipelined_frame();
+    } else {
+        build_triangles_to_render();
+    }
+}
+
+// Run the geometry stages of every mesh into one of the triangle lists,
+// spreading the faces over the thread pool if parallel
+void build_triangles(int list, bool parallel){
     // Initialize the counter of triangles to render for the current fram
-    num_triangles_to_render = 0;
+    num_triangles_in_list[list] = 0;
 
     // Loop all the meshes of our scene
     for (int mesh_index = 0; mesh_index < get_num_meshes(); mesh_index++){
@@ -336,69 +722,259 @@ void update(void){
         // mesh.rotation.z += 0.0 * delta_time;
         // mesh.translation.z = 4.0;
 
-        process_graphics_pipeline_stages(mesh);
+        process_graphics_pipeline_stages(mesh, list, parallel);
     }
 
+    // Sort the projected triangles so occluders reach the z-buffer first
+    order_triangles(triangle_lists[list], num_triangles_in_list[list]);
+}
+
+// Build the current frame straight into the list render() draws
+void build_triangles_to_render(void){
+    build_triangles(render_list, true);
+    num_triangles_to_render = num_triangles_in_list[render_list];
 }
 
 void render(void){
+    // Resolve the render method to specialized span kernels once for the frame
+    select_span_kernels();
+
     // Clear all the arrays to get ready for the next frame
     clear_color_buffer(0xFF000000);
     clear_z_buffer();
 
     draw_grid();
 
-    // Loop all projected triangles and render them
-    
-    for( int i = 0; i < num_triangles_to_render; i++ ) {
-        triangle_t triangle = triangles_to_render[i];
-
-        // Draw filled triangles
-        if( should_render_filled_triangles() ){
-            draw_filled_triangle(
-                triangle.points[0].x, triangle.points[0].y, triangle.points[0].z, triangle.points[0].w,
-                triangle.points[1].x, triangle.points[1].y, triangle.points[1].z, triangle.points[1].w,
-                triangle.points[2].x, triangle.points[2].y, triangle.points[2].z, triangle.points[2].w,
-                triangle.color
-            );
-        }
+    // Rasterize the filled/textured surfaces, binned in tiles across all worker threads
+    render_triangles(triangles_to_render, num_triangles_to_render);
 
-        // Draw textured triangle
-        if (should_render_textured_triangles()) {
-            draw_textured_triangle(
-                triangle.points[0].x, triangle.points[0].y, triangle.points[0].z, triangle.points[0].w, triangle.texcoords[0].u, triangle.texcoords[0].v,
-                triangle.points[1].x, triangle.points[1].y, triangle.points[1].z, triangle.points[1].w, triangle.texcoords[1].u, triangle.texcoords[1].v,
-                triangle.points[2].x, triangle.points[2].y, triangle.points[2].z, triangle.points[2].w, triangle.texcoords[2].u, triangle.texcoords[2].v,
-                triangle.texture
-            );
-        }
-
-        // Draw unfilled triangles -- Wireframe
-        if (should_render_wireframe()){
+    // Draw unfilled triangles -- Wireframe overlay on top of the surfaces
+    if (should_render_wireframe()) {
+        for (int i = 0; i < num_triangles_to_render; i++) {
+            triangle_t* triangle = &triangles_to_render[i];
             draw_triangle(
-                triangle.points[0].x, triangle.points[0].y,
-                triangle.points[1].x, triangle.points[1].y,
-                triangle.points[2].x, triangle.points[2].y,
+                triangle->points[0].x, triangle->points[0].y,
+                triangle->points[1].x, triangle->points[1].y,
+                triangle->points[2].x, triangle->points[2].y,
                 0xFFFFFFFF
             );
         }
+    }
 
-        // // Draw vertex points
-        if( should_render_wire_vertex()){
-            draw_rect(triangle.points[0].x - 3, triangle.points[0].y - 3, 6, 6, 0xFFFFFF00);
-            draw_rect(triangle.points[1].x - 3, triangle.points[1].y - 3, 6, 6, 0xFFFFFF00);
-            draw_rect(triangle.points[2].x - 3, triangle.points[2].y - 3, 6, 6, 0xFFFFFF00);
+    // Draw vertex points
+    if (should_render_wire_vertex()) {
+        for (int i = 0; i < num_triangles_to_render; i++) {
+            triangle_t* triangle = &triangles_to_render[i];
+            draw_rect(triangle->points[0].x - 3, triangle->points[0].y - 3, 6, 6, 0xFFFFFF00);
+            draw_rect(triangle->points[1].x - 3, triangle->points[1].y - 3, 6, 6, 0xFFFFFF00);
+            draw_rect(triangle->points[2].x - 3, triangle->points[2].y - 3, 6, 6, 0xFFFFFF00);
         }
     }
 
     render_color_buffer();
 
+    // The next frame's geometry has to be done before input touches the scene
+    finish_pipelined_frame();
+
+    print_frame_stats();
+
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Texture benchmarks
+///////////////////////////////////////////////////////////////////////////////
+// Time the surface rasterization of the current scene under two texture
+// settings, with the meshes rolled to a few angles so the spans walk texture
+// space along u, along v and diagonally. Only the raster work is timed; the
+// geometry is rebuilt untimed for every frame.
+///////////////////////////////////////////////////////////////////////////////
+#define BENCHMARK_FRAMES 20
+
+static int benchmark_angles[] = { 0, 30, 45, 60, 90 };
+#define NUM_BENCHMARK_ANGLES (int)(sizeof(benchmark_angles) / sizeof(benchmark_angles[0]))
+
+// Average raster time in ms of a frame with the meshes rolled by angle degrees
+static double time_raster_frames(int angle){
+    Uint64 raster_ticks = 0;
+    for (int frame = 0; frame < BENCHMARK_FRAMES; frame++) {
+        // Roll the meshes, build the frame and put them back
+        for (int i = 0; i < get_num_meshes(); i++) {
+            get_mesh(i)->rotation.z += angle * M_PI / 180.0;
+        }
+        build_triangles_to_render();
+        for (int i = 0; i < get_num_meshes(); i++) {
+            get_mesh(i)->rotation.z -= angle * M_PI / 180.0;
+        }
+
+        select_span_kernels();
+        clear_color_buffer(0xFF000000);
+        clear_z_buffer();
+        Uint64 start = SDL_GetPerformanceCounter();
+        render_triangles(triangles_to_render, num_triangles_to_render);
+        raster_ticks += SDL_GetPerformanceCounter() - start;
+    }
+    return 1000.0 * raster_ticks / SDL_GetPerformanceFrequency() / BENCHMARK_FRAMES;
+}
+
+// Row-major against tiled texels
+void benchmark_texture_layouts(void){
+    int original_layout = get_texture_layout();
+
+    printf("---- texture layout benchmark, ms per frame (%d frames) ----\n", BENCHMARK_FRAMES);
+    printf("%-8s %10s %10s %10s\n", "angle", get_texture_layout_name(TEXTURE_LAYOUT_LINEAR), get_texture_layout_name(TEXTURE_LAYOUT_TILED), "speedup");
+
+    for (int a = 0; a < NUM_BENCHMARK_ANGLES; a++) {
+        int angle = benchmark_angles[a];
+        double frame_ms[NUM_TEXTURE_LAYOUTS];
+        for (int layout = 0; layout < NUM_TEXTURE_LAYOUTS; layout++) {
+            for (int i = 0; i < get_num_meshes(); i++) {
+                convert_texture_layout(get_mesh(i)->texture, layout);
+            }
+            frame_ms[layout] = time_raster_frames(angle);
+        }
+        printf("%-8d %10.3f %10.3f %9.2fx\n", angle,
+            frame_ms[TEXTURE_LAYOUT_LINEAR], frame_ms[TEXTURE_LAYOUT_TILED],
+            frame_ms[TEXTURE_LAYOUT_LINEAR] / frame_ms[TEXTURE_LAYOUT_TILED]);
+    }
+
+    for (int i = 0; i < get_num_meshes(); i++) {
+        convert_texture_layout(get_mesh(i)->texture, original_layout);
+    }
+}
+
+// Nearest against bilinear filtering, with the current span kernels
+void benchmark_texture_filters(void){
+    int* original_filters = (int*)malloc(sizeof(int) * get_num_meshes());
+    for (int i = 0; i < get_num_meshes(); i++) {
+        if (get_mesh(i)->texture) {
+            original_filters[i] = get_mesh(i)->texture->filter;
+        }
+    }
+
+    printf("---- texture filter benchmark, ms per frame (%d frames) ----\n", BENCHMARK_FRAMES);
+    printf("%-8s %10s %10s %10s\n", "angle", "nearest", "bilinear", "cost");
+
+    for (int a = 0; a < NUM_BENCHMARK_ANGLES; a++) {
+        int angle = benchmark_angles[a];
+        double frame_ms[2];
+        for (int filter = TEXTURE_FILTER_NEAREST; filter <= TEXTURE_FILTER_BILINEAR; filter++) {
+            for (int i = 0; i < get_num_meshes(); i++) {
+                if (get_mesh(i)->texture) {
+                    get_mesh(i)->texture->filter = filter;
+                }
+            }
+            frame_ms[filter] = time_raster_frames(angle);
+        }
+        printf("%-8d %10.3f %10.3f %9.2fx\n", angle,
+            frame_ms[TEXTURE_FILTER_NEAREST], frame_ms[TEXTURE_FILTER_BILINEAR],
+            frame_ms[TEXTURE_FILTER_BILINEAR] / frame_ms[TEXTURE_FILTER_NEAREST]);
+    }
+
+    for (int i = 0; i < get_num_meshes(); i++) {
+        if (get_mesh(i)->texture) {
+            get_mesh(i)->texture->filter = original_filters[i];
+        }
+    }
+    free(original_filters);
+}
+
+// RGBA32 against BC1 textures, memory and raster time with either filter.
+// Each mesh renders from a copy of its texture in each format, so the loaded
+// textures are left untouched. Untextured meshes and virtual textures, which
+// cannot be copied, keep their own texture and filter.
+void benchmark_texture_formats(void){
+    int num_meshes = get_num_meshes();
+    texture_t** original_textures = (texture_t**)malloc(sizeof(texture_t*) * num_meshes);
+    texture_t** format_textures[NUM_TEXTURE_FORMATS];
+    for (int format = 0; format < NUM_TEXTURE_FORMATS; format++) {
+        format_textures[format] = (texture_t**)malloc(sizeof(texture_t*) * num_meshes);
+    }
+
+    printf("---- texture format memory, KiB ----\n");
+    printf("%-8s %10s %10s %10s\n", "mesh", get_texture_format_name(TEXTURE_FORMAT_RGBA32), get_texture_format_name(TEXTURE_FORMAT_BC1), "saving");
+    for (int i = 0; i < num_meshes; i++) {
+        original_textures[i] = get_mesh(i)->texture;
+        if (!original_textures[i] || original_textures[i]->virtual_texture) {
+            for (int format = 0; format < NUM_TEXTURE_FORMATS; format++) {
+                format_textures[format][i] = original_textures[i];
+            }
+            continue;
+        }
+        for (int format = 0; format < NUM_TEXTURE_FORMATS; format++) {
+            format_textures[format][i] = copy_texture(original_textures[i]);
+            convert_texture_format(format_textures[format][i], format);
+        }
+        double rgba32_kib = get_texture_memory_size(format_textures[TEXTURE_FORMAT_RGBA32][i]) / 1024.0;
+        double bc1_kib = get_texture_memory_size(format_textures[TEXTURE_FORMAT_BC1][i]) / 1024.0;
+        printf("%-8d %10.1f %10.1f %9.1f%%\n", i, rgba32_kib, bc1_kib, 100.0 * (1.0 - bc1_kib / rgba32_kib));
+    }
+
+    printf("---- texture format benchmark, ms per frame (%d frames) ----\n", BENCHMARK_FRAMES);
+    printf("%-8s %10s %10s %8s %10s %10s %8s\n", "angle", "nearest", "bc1", "cost", "bilinear", "bc1", "cost");
+    for (int a = 0; a < NUM_BENCHMARK_ANGLES; a++) {
+        int angle = benchmark_angles[a];
+        double frame_ms[2][NUM_TEXTURE_FORMATS];
+        for (int filter = TEXTURE_FILTER_NEAREST; filter <= TEXTURE_FILTER_BILINEAR; filter++) {
+            for (int format = 0; format < NUM_TEXTURE_FORMATS; format++) {
+                for (int i = 0; i < num_meshes; i++) {
+                    if (format_textures[format][i] != original_textures[i]) {
+                        format_textures[format][i]->filter = filter;
+                    }
+                    get_mesh(i)->texture = format_textures[format][i];
+                }
+                frame_ms[filter][format] = time_raster_frames(angle);
+            }
+        }
+        printf("%-8d %10.3f %10.3f %7.2fx %10.3f %10.3f %7.2fx\n", angle,
+            frame_ms[TEXTURE_FILTER_NEAREST][TEXTURE_FORMAT_RGBA32], frame_ms[TEXTURE_FILTER_NEAREST][TEXTURE_FORMAT_BC1],
+            frame_ms[TEXTURE_FILTER_NEAREST][TEXTURE_FORMAT_BC1] / frame_ms[TEXTURE_FILTER_NEAREST][TEXTURE_FORMAT_RGBA32],
+            frame_ms[TEXTURE_FILTER_BILINEAR][TEXTURE_FORMAT_RGBA32], frame_ms[TEXTURE_FILTER_BILINEAR][TEXTURE_FORMAT_BC1],
+            frame_ms[TEXTURE_FILTER_BILINEAR][TEXTURE_FORMAT_BC1] / frame_ms[TEXTURE_FILTER_BILINEAR][TEXTURE_FORMAT_RGBA32]);
+    }
+
+    for (int i = 0; i < num_meshes; i++) {
+        get_mesh(i)->texture = original_textures[i];
+        for (int format = 0; format < NUM_TEXTURE_FORMATS; format++) {
+            if (format_textures[format][i] != original_textures[i]) {
+                free_texture(format_textures[format][i]);
+            }
+        }
+    }
+    for (int format = 0; format < NUM_TEXTURE_FORMATS; format++) {
+        free(format_textures[format]);
+    }
+    free(original_textures);
+}
+
+// Memory of every mesh with per-corner faces against the indexed layout
+void print_mesh_memory(void){
+    printf("---- mesh memory, KiB ----\n");
+    printf("%-8s %10s %10s %10s %10s %10s\n", "mesh", "faces", "vertices", "per-corner", "indexed", "saving");
+    for (int i = 0; i < get_num_meshes(); i++) {
+        mesh_t* mesh = get_mesh(i);
+        double unindexed_kib = mesh->unindexed_memory_size / 1024.0;
+        double indexed_kib = get_mesh_memory_size(mesh) / 1024.0;
+        printf("%-8d %10d %10d %10.1f %10.1f %9.1f%%\n", i, array_length(mesh->faces), mesh->vertex_streams.count,
+            unindexed_kib, indexed_kib, unindexed_kib > 0 ? 100.0 * (1.0 - indexed_kib / unindexed_kib) : 0.0);
+    }
 }
 
 // Free memory that was dynamically allocated by the program
 void free_resources(void){
     
+    free_frame_pipelining();
     free_meshes();
+    free(camera_vertices);
+    free(camera_outcodes);
+    for (int i = 0; i < geometry_chunks_capacity; i++) {
+        free(geometry_chunks[i].triangles);
+    }
+    free(geometry_chunks);
+    free_virtual_texturing();
+    free_tiles();
+    free_visibility_buffer();
+    free_triangle_ordering();
+    free_thread_pool();
     destroy_window();
 
 }
@@ -1,8 +1,11 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <math.h>
 #include "array.h"
 #include "mesh.h"
 #include "upng.h"
+#include "virtual_texture.h"
 
 #define MAX_NUM_MESHES 1000000
 static mesh_t meshes[MAX_NUM_MESHES];
@@ -20,6 +23,113 @@ void load_mesh(char* obj_filename, char* png_filename, vec3_t scale, vec3_t tran
 
 }
 
+///////////////////////////////////////////////////////////////////////////////
+// Indexed meshes
+///////////////////////////////////////////////////////////////////////////////
+// An OBJ face corner names a position, a texture coordinate and a normal by
+// separate indices. The loader turns every distinct (position, texcoord) pair
+// into one vertex of the mesh and every face into three indices into that
+// vertex table, so a corner shared by several faces is stored, and later
+// transformed, once. Normals are left out of the key: the pipeline shades
+// with face normals, and keying on them would only split vertices along
+// hard edges. The positions of the vertex table are only kept as the x, y and
+// z streams the batched transform reads.
+///////////////////////////////////////////////////////////////////////////////
+
+// Bytes of a face in the old per-corner layout: three position indices, three
+// copied texture coordinates and a color
+#define UNINDEXED_FACE_SIZE (3 * sizeof(int) + 3 * sizeof(tex2_t) + sizeof(uint32_t))
+
+// Position and texture coordinate indices of a face corner, 0-based
+typedef struct {
+    int position;
+    int texcoord;
+} face_corner_t;
+
+static uint32_t hash_face_corner(face_corner_t corner) {
+    return ((uint32_t)corner.position * 73856093u) ^ ((uint32_t)corner.texcoord * 19349663u);
+}
+
+// Turn the parsed face corners, three per face, into the vertex table and the
+// index triples of the mesh
+static void build_indexed_mesh(mesh_t* mesh, vec3_t* positions, tex2_t* texcoords, face_corner_t* corners) {
+    int num_corners = array_length(corners);
+
+    // Open addressing table from corner to vertex index, at most half full
+    int table_size = 1;
+    while (table_size < 2 * num_corners) {
+        table_size <<= 1;
+    }
+    int* table = (int*)malloc(sizeof(int) * table_size);
+    memset(table, -1, sizeof(int) * table_size);
+    face_corner_t* vertex_corners = (face_corner_t*)malloc(sizeof(face_corner_t) * (num_corners > 0 ? num_corners : 1));
+    vec3_t* vertices = NULL;
+    int num_vertices = 0;
+
+    uint32_t indices[3];
+    for (int i = 0; i < num_corners; i++) {
+        face_corner_t corner = corners[i];
+        uint32_t slot = hash_face_corner(corner) & (table_size - 1);
+        while (table[slot] >= 0) {
+            face_corner_t existing = vertex_corners[table[slot]];
+            if (existing.position == corner.position && existing.texcoord == corner.texcoord) {
+                break;
+            }
+            slot = (slot + 1) & (table_size - 1);
+        }
+        if (table[slot] < 0) {
+            // First use of the pair: it becomes the next vertex
+            table[slot] = num_vertices;
+            vertex_corners[num_vertices++] = corner;
+            array_push(vertices, positions[corner.position]);
+            array_push(mesh->texcoords, texcoords[corner.texcoord]);
+        }
+
+        indices[i % 3] = table[slot];
+        if (i % 3 == 2) {
+            face_t face = { .a = indices[0], .b = indices[1], .c = indices[2] };
+            array_push(mesh->faces, face);
+        }
+    }
+    init_vertex_streams(&mesh->vertex_streams, vertices, num_vertices);
+    array_free(vertices);
+    free(vertex_corners);
+    free(table);
+}
+
+// Bounding box of the vertices, and a sphere around the box center that
+// holds them all
+static void compute_mesh_bounds(mesh_t* mesh) {
+    const vertex_streams_t* streams = &mesh->vertex_streams;
+    int num_vertices = streams->count;
+    if (num_vertices == 0) {
+        mesh->bounds_min = mesh->bounds_max = mesh->bounds_center = vec3_new(0, 0, 0);
+        mesh->bounds_radius = 0;
+        return;
+    }
+
+    vec3_t min = vec3_new(streams->x[0], streams->y[0], streams->z[0]);
+    vec3_t max = min;
+    for (int i = 1; i < num_vertices; i++) {
+        vec3_t v = vec3_new(streams->x[i], streams->y[i], streams->z[i]);
+        min.x = fminf(min.x, v.x); max.x = fmaxf(max.x, v.x);
+        min.y = fminf(min.y, v.y); max.y = fmaxf(max.y, v.y);
+        min.z = fminf(min.z, v.z); max.z = fmaxf(max.z, v.z);
+    }
+    vec3_t center = vec3_mul(vec3_add(min, max), 0.5);
+
+    float radius = 0;
+    for (int i = 0; i < num_vertices; i++) {
+        vec3_t v = vec3_new(streams->x[i], streams->y[i], streams->z[i]);
+        radius = fmaxf(radius, vec3_length(vec3_sub(v, center)));
+    }
+
+    mesh->bounds_min = min;
+    mesh->bounds_max = max;
+    mesh->bounds_center = center;
+    mesh->bounds_radius = radius;
+}
+
 void load_mesh_obj_data(mesh_t* mesh, char* obj_filename){
 
     FILE* file = fopen(obj_filename, "r");
@@ -30,13 +140,15 @@ void load_mesh_obj_data(mesh_t* mesh, char* obj_filename){
 
     char line[1024];
 
+    vec3_t* positions = NULL;
     tex2_t* texcoords = NULL;
+    face_corner_t* corners = NULL;
 
     while (fgets(line, 1024, file) ){
         if( strncmp(line, "v ", 2) == 0){
             vec3_t vertex;
             sscanf(line, "v %f %f %f", &vertex.x, &vertex.y, &vertex.z);
-            array_push(meshes[mesh_count].vertices, vertex);
+            array_push(positions, vertex);
         }
 
         // Texture coordinate information
@@ -56,30 +168,45 @@ void load_mesh_obj_data(mesh_t* mesh, char* obj_filename){
                 &vertex_indices[1], &texture_indices[1], &normal_indices[1],
                 &vertex_indices[2], &texture_indices[2], &normal_indices[2]
             );
-            face_t face = {
-                .a = vertex_indices[0],
-                .b = vertex_indices[1],
-                .c = vertex_indices[2],
-                .a_uv = texcoords[texture_indices[0] - 1],  // -1 cuz, the indexing in .obj starts from 1;
-                .b_uv = texcoords[texture_indices[1] - 1],
-                .c_uv = texcoords[texture_indices[2] - 1],
-                .color = 0xFFFFFFFF
-            };
-
-            array_push(mesh->faces, face);
+            for (int j = 0; j < 3; j++) {
+                // -1 cuz, the indexing in .obj starts from 1
+                face_corner_t corner = { vertex_indices[j] - 1, texture_indices[j] - 1 };
+                array_push(corners, corner);
+            }
         }
     }
-    array_free(texcoords);
     fclose(file);
+
+    mesh->color = 0xFFFFFFFF;
+    mesh->unindexed_memory_size = sizeof(vec3_t) * array_length(positions) + UNINDEXED_FACE_SIZE * (array_length(corners) / 3);
+    build_indexed_mesh(mesh, positions, texcoords, corners);
+    compute_mesh_bounds(mesh);
+
+    array_free(corners);
+    array_free(texcoords);
+    array_free(positions);
+}
+
+// Bytes of the vertex table (position streams and texture coordinates) and faces
+size_t get_mesh_memory_size(const mesh_t* mesh) {
+    return 3 * sizeof(float) * mesh->vertex_streams.padded_count +
+        sizeof(tex2_t) * array_length(mesh->texcoords) +
+        sizeof(face_t) * array_length(mesh->faces);
 }
 
 void load_mesh_png_data(mesh_t* mesh, char* png_filename) {
+    if (is_virtual_texturing()) {
+        mesh->texture = load_virtual_texture(png_filename);
+        return;
+    }
     upng_t* png_image = upng_new_from_file(png_filename);
     if(png_image != NULL) {
         upng_decode(png_image);
         if(upng_get_error(png_image) == UPNG_EOK) {
-            mesh->texture = png_image;
+            // The render texture keeps its own copy of the texels
+            mesh->texture = texture_from_png(png_image);
         }
+        upng_free(png_image);
     }
 }
 
@@ -93,8 +220,9 @@ mesh_t* get_mesh(int index){
 
 void free_meshes(void){
     for(int i = 0; i < mesh_count; i++){
-        upng_free(meshes[i].texture);
+        free_texture(meshes[i].texture);
         array_free(meshes[i].faces);
-        array_free(meshes[i].vertices);
+        array_free(meshes[i].texcoords);
+        free_vertex_streams(&meshes[i].vertex_streams);
     }
 }
\ No newline at end of file
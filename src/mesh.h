@@ -1,16 +1,27 @@
 #ifndef MESH_H
 #define MESH_H
 
+#include <stddef.h>
+#include <stdint.h>
 #include "vector.h"
 #include "triangle.h"
+#include "texture.h"
+#include "transform.h"
 #include "upng.h"
 
 // Define a struct for dynamic size meshes, with array of vertices and faces
 
 typedef struct{
-    vec3_t* vertices;   // dynamic array of vertices
-    face_t* faces;      // dynamic array of faces
-    upng_t* texture;    // Mesh png texture pointer
+    vertex_streams_t vertex_streams; // Vertex positions as x, y and z streams
+    tex2_t* texcoords;  // dynamic array of vertex texture coordinates
+    face_t* faces;      // dynamic array of faces, indexing the vertices
+    uint32_t color;     // Color of every face
+    size_t unindexed_memory_size; // Bytes the mesh took with per-corner faces
+    vec3_t bounds_min;  // Model space bounding box
+    vec3_t bounds_max;
+    vec3_t bounds_center; // Model space bounding sphere
+    float bounds_radius;
+    texture_t* texture; // Mesh texture with its mip chain
     vec3_t rotation;    // rotation with x,y and z values
     vec3_t scale;       // Scale with x,y and z values
     vec3_t translation; // Translation with x,y and z
@@ -22,6 +33,7 @@ void load_mesh_png_data(mesh_t* mesh, char* png_filename);
 
 int get_num_meshes(void);
 mesh_t* get_mesh(int index);
+size_t get_mesh_memory_size(const mesh_t* mesh);
 
 void free_meshes(void);
 
@@ -0,0 +1,171 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "ordering.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Triangle ordering stage
+///////////////////////////////////////////////////////////////////////////////
+// The geometry stage emits triangles in file face order, so whether a hidden
+// fragment is rejected by the depth test (or Hi-Z) before it is textured is
+// down to luck. This stage reorders the projected triangles front to back on
+// their nearest depth, so the occluders land in the z-buffer first.
+//
+// Every triangle gets a 32-bit key and the keys are sorted with an LSD radix
+// sort (8 bits per pass, stable, linear time). The key is the nearest depth
+// quantized to 24 bits; the texture order also puts a texture rank in the top
+// 8 bits so triangles sharing a texture are drawn together and keep their
+// texels hot in cache:
+//
+//     31      24 23                          0
+//     +---------+-----------------------------+
+//     | texture |       quantized depth       |
+//     +---------+-----------------------------+
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#define DEPTH_KEY_BITS 24
+#define MAX_TEXTURE_RANKS 255
+
+static int triangle_order = ORDER_SUBMISSION;
+
+static uint32_t* sort_keys = NULL;
+static uint32_t* sort_scratch_keys = NULL;
+static int* sort_indices = NULL;
+static int* sort_scratch_indices = NULL;
+static triangle_t* sorted_triangles = NULL;
+static int sort_capacity = 0;
+
+static const char* order_names[] = {
+    "submission",
+    "front to back",
+    "texture, front to back"
+};
+
+void set_triangle_order(int order) {
+    triangle_order = order;
+}
+
+int get_triangle_order(void) {
+    return triangle_order;
+}
+
+const char* get_triangle_order_name(void) {
+    return order_names[triangle_order];
+}
+
+static void reserve_sort_buffers(int num_triangles) {
+    if (num_triangles <= sort_capacity) {
+        return;
+    }
+    sort_capacity = num_triangles;
+    sort_keys = (uint32_t*)realloc(sort_keys, sizeof(uint32_t) * sort_capacity);
+    sort_scratch_keys = (uint32_t*)realloc(sort_scratch_keys, sizeof(uint32_t) * sort_capacity);
+    sort_indices = (int*)realloc(sort_indices, sizeof(int) * sort_capacity);
+    sort_scratch_indices = (int*)realloc(sort_scratch_indices, sizeof(int) * sort_capacity);
+    sorted_triangles = (triangle_t*)realloc(sorted_triangles, sizeof(triangle_t) * sort_capacity);
+}
+
+// Nearest depth of the triangle (the same 1 - 1/w the z-buffer stores), in 24 bits
+static uint32_t depth_key(triangle_t* triangle) {
+    float max_reciprocal_w = 1 / triangle->points[0].w;
+    for (int i = 1; i < 3; i++) {
+        float reciprocal_w = 1 / triangle->points[i].w;
+        if (reciprocal_w > max_reciprocal_w) max_reciprocal_w = reciprocal_w;
+    }
+    float depth = 1.0 - max_reciprocal_w;
+    if (!(depth > 0)) return 0;
+    if (depth >= 1) return (1 << DEPTH_KEY_BITS) - 1;
+    return (uint32_t)(depth * (1 << DEPTH_KEY_BITS));
+}
+
+// Textures are ranked in the order they first show up this frame
+static uint32_t texture_key(texture_t* texture, texture_t** ranked_textures, int* num_ranked) {
+    for (int i = 0; i < *num_ranked; i++) {
+        if (ranked_textures[i] == texture) return i;
+    }
+    if (*num_ranked == MAX_TEXTURE_RANKS) {
+        return MAX_TEXTURE_RANKS;
+    }
+    ranked_textures[*num_ranked] = texture;
+    return (*num_ranked)++;
+}
+
+// Stable LSD radix sort of (key, index) pairs, one byte per pass
+static void radix_sort(int count) {
+    for (int shift = 0; shift < 32; shift += 8) {
+        int histogram[257] = { 0 };
+        for (int i = 0; i < count; i++) {
+            histogram[((sort_keys[i] >> shift) & 0xFF) + 1]++;
+        }
+
+        // All keys share this byte, so the pass would not move anything
+        if (histogram[((sort_keys[0] >> shift) & 0xFF) + 1] == count) {
+            continue;
+        }
+
+        for (int i = 0; i < 256; i++) {
+            histogram[i + 1] += histogram[i];
+        }
+        for (int i = 0; i < count; i++) {
+            int slot = histogram[(sort_keys[i] >> shift) & 0xFF]++;
+            sort_scratch_keys[slot] = sort_keys[i];
+            sort_scratch_indices[slot] = sort_indices[i];
+        }
+
+        uint32_t* keys = sort_keys;
+        sort_keys = sort_scratch_keys;
+        sort_scratch_keys = keys;
+        int* indices = sort_indices;
+        sort_indices = sort_scratch_indices;
+        sort_scratch_indices = indices;
+    }
+}
+
+// Reorder the triangles in place according to the current triangle order
+void order_triangles(triangle_t* triangles, int num_triangles) {
+    if (triangle_order == ORDER_SUBMISSION || num_triangles < 2) {
+        return;
+    }
+    reserve_sort_buffers(num_triangles);
+
+    texture_t* ranked_textures[MAX_TEXTURE_RANKS];
+    int num_ranked = 0;
+    texture_t* last_texture = NULL;
+    uint32_t last_texture_key = 0;
+
+    for (int i = 0; i < num_triangles; i++) {
+        uint32_t key = depth_key(&triangles[i]);
+        if (triangle_order == ORDER_TEXTURE_FRONT_TO_BACK) {
+            // Consecutive triangles almost always come from the same mesh
+            if (num_ranked == 0 || triangles[i].texture != last_texture) {
+                last_texture = triangles[i].texture;
+                last_texture_key = texture_key(last_texture, ranked_textures, &num_ranked);
+            }
+            key |= last_texture_key << DEPTH_KEY_BITS;
+        }
+        sort_keys[i] = key;
+        sort_indices[i] = i;
+    }
+
+    radix_sort(num_triangles);
+
+    for (int i = 0; i < num_triangles; i++) {
+        sorted_triangles[i] = triangles[sort_indices[i]];
+    }
+    memcpy(triangles, sorted_triangles, sizeof(triangle_t) * num_triangles);
+}
+
+void free_triangle_ordering(void) {
+    free(sort_keys);
+    free(sort_scratch_keys);
+    free(sort_indices);
+    free(sort_scratch_indices);
+    free(sorted_triangles);
+    sort_keys = NULL;
+    sort_scratch_keys = NULL;
+    sort_indices = NULL;
+    sort_scratch_indices = NULL;
+    sorted_triangles = NULL;
+    sort_capacity = 0;
+}
@@ -0,0 +1,19 @@
+#ifndef ORDERING_H
+#define ORDERING_H
+
+#include "triangle.h"
+
+enum triangle_order {
+    ORDER_SUBMISSION,
+    ORDER_FRONT_TO_BACK,
+    ORDER_TEXTURE_FRONT_TO_BACK
+};
+
+void set_triangle_order(int order);
+int get_triangle_order(void);
+const char* get_triangle_order_name(void);
+
+void order_triangles(triangle_t* triangles, int num_triangles);
+void free_triangle_ordering(void);
+
+#endif
@@ -0,0 +1,1124 @@
+#include <stdlib.h>
+#include <math.h>
+#include <SDL2/SDL.h>
+#include "display.h"
+#include "span.h"
+#include "stats.h"
+#include "bc1.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Span kernels
+///////////////////////////////////////////////////////////////////////////////
+// The rasterizer walks each triangle row by row and hands every horizontal
+// span to one of these kernels. The scalar kernels are the reference
+// implementation. On x86 the SSE4.1 and AVX2 kernels process 4 or 8 pixels
+// per iteration: depth test against the z-buffer, perspective divide, texel
+// gather and masked color/depth stores. The widest kernel the CPU supports
+// is picked once at startup by init_span_kernels().
+//
+// Every kernel body is written once, generic over the raster pass, and
+// DEFINE_SPAN_KERNELS() stamps out one specialized copy per pass with the
+// pass as a compile-time constant. The depth test variant and the color and
+// depth writes are then resolved by the compiler, so the pixel loops carry
+// no mode branches. select_span_kernels() picks the kernel tables once per
+// frame from the render method.
+///////////////////////////////////////////////////////////////////////////////
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SPAN_X86_KERNELS
+#include <immintrin.h>
+#define SPAN_TARGET(isa) __attribute__((target(isa)))
+#endif
+
+#if defined(__GNUC__)
+#define SPAN_INLINE inline __attribute__((always_inline))
+#else
+#define SPAN_INLINE inline
+#endif
+
+// Instantiate a generic kernel body once per raster pass. The visibility
+// pass only differs from the single pass in its render target. Depth-only
+// rasterization always goes through the flat kernels, so the depth variant
+// of a textured kernel is never selected.
+#define DEFINE_SPAN_KERNELS(kernel, target)                                                 \
+    target static int kernel##_single(int y, int x_start, int x_end, const triangle_setup_t* setup) { \
+        return kernel(y, x_start, x_end, setup, RASTER_PASS_SINGLE);                       \
+    }                                                                                      \
+    target static int kernel##_depth(int y, int x_start, int x_end, const triangle_setup_t* setup) {  \
+        return kernel(y, x_start, x_end, setup, RASTER_PASS_DEPTH);                        \
+    }                                                                                      \
+    target static int kernel##_shade(int y, int x_start, int x_end, const triangle_setup_t* setup) {  \
+        return kernel(y, x_start, x_end, setup, RASTER_PASS_SHADE);                        \
+    }                                                                                      \
+    static const span_function_t kernel##_passes[NUM_RASTER_PASSES] = {                    \
+        kernel##_single, kernel##_depth, kernel##_shade, kernel##_single                  \
+    };
+
+// Depth test of one pixel: strictly closer, or matching the pre-pass depth.
+// Depth is evaluated per pixel with triangle_reciprocal_w_at() rather than
+// accumulated along the span, so the match is exact even when the two passes
+// split a row into different spans.
+static SPAN_INLINE bool depth_test(float depth, float stored_depth, const int raster_pass) {
+    if (raster_pass == RASTER_PASS_SHADE) {
+        return depth <= stored_depth;
+    }
+    return depth < stored_depth;
+}
+
+static const span_function_t* flat_span_kernels = NULL;
+static const span_function_t* textured_span_kernels = NULL;
+static const span_function_t* bilinear_span_kernels = NULL;
+static const span_function_t* simd_flat_span_kernels = NULL;
+static const span_function_t* simd_textured_span_kernels = NULL;
+static const span_function_t* simd_bilinear_span_kernels = NULL;
+static const char* simd_kernel_name = NULL;
+static bool simd_spans = true;
+static int affine_span_length = 16;
+
+///////////////////////////////////////////////////////////////////////////////
+// Scalar reference kernels
+///////////////////////////////////////////////////////////////////////////////
+
+// Draw a horizontal run of flat-colored pixels [x_start, x_end) on row y
+static SPAN_INLINE int draw_flat_span_scalar(int y, int x_start, int x_end, const triangle_setup_t* setup, const int raster_pass){
+    const bool write_color = raster_pass != RASTER_PASS_DEPTH;
+    const bool write_depth = raster_pass != RASTER_PASS_SHADE;
+    uint32_t* color_row = setup->target_buffer + y * get_window_width();
+    float* depth_row = get_z_buffer() + y * get_window_width();
+    float row_reciprocal_w = triangle_row_reciprocal_w(setup, y);
+    int fragments = 0;
+
+    for (int x = x_start; x < x_end; x++) {
+        float reciprocal_w = triangle_reciprocal_w_at(row_reciprocal_w, setup->reciprocal_w.dx, x);
+        // Adjust 1/w so the pixels that are closer to the camera have smaller values
+        float depth = 1.0 - reciprocal_w;
+
+        // Only draw the pixel if the depth value is less than the one previously stored in z-buffer
+        if (depth_test(depth, depth_row[x], raster_pass)) {
+            if (write_color) color_row[x] = setup->color;
+            if (write_depth) depth_row[x] = depth;
+            fragments++;
+        }
+    }
+    return fragments;
+}
+
+DEFINE_SPAN_KERNELS(draw_flat_span_scalar, )
+
+// Draw a horizontal run of textured pixels [x_start, x_end) on row y
+static SPAN_INLINE int draw_textured_span_scalar(int y, int x_start, int x_end, const triangle_setup_t* setup, const int raster_pass){
+    const bool write_depth = raster_pass != RASTER_PASS_SHADE;
+    uint32_t* color_row = setup->target_buffer + y * get_window_width();
+    float* depth_row = get_z_buffer() + y * get_window_width();
+    float row_reciprocal_w = triangle_row_reciprocal_w(setup, y);
+    float u_over_w = triangle_gradient_at(setup->u_over_w, setup->point_a, x_start, y);
+    float v_over_w = triangle_gradient_at(setup->v_over_w, setup->point_a, x_start, y);
+
+    const texture_level_t* level = setup->texture_level;
+    int texture_width = level->width;
+    int texture_height = level->height;
+    int width_mask = level->width_mask;
+    int height_mask = level->height_mask;
+    int min_texel = level->min_texel;
+    int max_texel_x = level->max_texel_x;
+    int max_texel_y = level->max_texel_y;
+    int fragments = 0;
+
+    for (int x = x_start; x < x_end; x++) {
+        float reciprocal_w = triangle_reciprocal_w_at(row_reciprocal_w, setup->reciprocal_w.dx, x);
+        // Adjust 1/w so pixel closer to camera have smaller values
+        float depth = 1.0 - reciprocal_w;
+
+        // Only draw pixel if depth value is less than previously stored in the z-buffer
+        if (depth_test(depth, depth_row[x], raster_pass)) {
+            // Divide back both interpolated values by 1/w
+            float interpolated_u = u_over_w / reciprocal_w;
+            float interpolated_v = v_over_w / reciprocal_w;
+
+            // Map the UV coordinates to the full texture width and height
+            int tex_x = address_texel((int)floorf(interpolated_u * texture_width), min_texel, max_texel_x, width_mask);
+            int tex_y = address_texel((int)floorf(interpolated_v * texture_height), min_texel, max_texel_y, height_mask);
+
+            color_row[x] = level->texels[texel_offset(level, tex_x, tex_y)];
+
+            // Update the z-buffer value with the 1/w of this current pixel
+            if (write_depth) depth_row[x] = depth;
+            fragments++;
+        }
+        u_over_w += setup->u_over_w.dx;
+        v_over_w += setup->v_over_w.dx;
+    }
+    return fragments;
+}
+
+DEFINE_SPAN_KERNELS(draw_textured_span_scalar, )
+
+// Same as draw_textured_span_scalar() with a 2x2 bilinear filtered texel
+static SPAN_INLINE int draw_bilinear_span_scalar(int y, int x_start, int x_end, const triangle_setup_t* setup, const int raster_pass){
+    const bool write_depth = raster_pass != RASTER_PASS_SHADE;
+    uint32_t* color_row = setup->target_buffer + y * get_window_width();
+    float* depth_row = get_z_buffer() + y * get_window_width();
+    float row_reciprocal_w = triangle_row_reciprocal_w(setup, y);
+    float u_over_w = triangle_gradient_at(setup->u_over_w, setup->point_a, x_start, y);
+    float v_over_w = triangle_gradient_at(setup->v_over_w, setup->point_a, x_start, y);
+
+    int fragments = 0;
+
+    for (int x = x_start; x < x_end; x++) {
+        float reciprocal_w = triangle_reciprocal_w_at(row_reciprocal_w, setup->reciprocal_w.dx, x);
+        float depth = 1.0 - reciprocal_w;
+        if (depth_test(depth, depth_row[x], raster_pass)) {
+            color_row[x] = sample_texture_bilinear(setup->texture_level, u_over_w / reciprocal_w, v_over_w / reciprocal_w);
+            if (write_depth) depth_row[x] = depth;
+            fragments++;
+        }
+        u_over_w += setup->u_over_w.dx;
+        v_over_w += setup->v_over_w.dx;
+    }
+    return fragments;
+}
+
+DEFINE_SPAN_KERNELS(draw_bilinear_span_scalar, )
+
+// Same as draw_textured_span_scalar() for a BC1 level. Neighbouring pixels
+// mostly land in the same 4x4 block, so the palette is only decoded when the
+// span walks onto another block.
+static SPAN_INLINE int draw_bc1_span_scalar(int y, int x_start, int x_end, const triangle_setup_t* setup, const int raster_pass){
+    const bool write_depth = raster_pass != RASTER_PASS_SHADE;
+    uint32_t* color_row = setup->target_buffer + y * get_window_width();
+    float* depth_row = get_z_buffer() + y * get_window_width();
+    float row_reciprocal_w = triangle_row_reciprocal_w(setup, y);
+    float u_over_w = triangle_gradient_at(setup->u_over_w, setup->point_a, x_start, y);
+    float v_over_w = triangle_gradient_at(setup->v_over_w, setup->point_a, x_start, y);
+
+    const texture_level_t* level = setup->texture_level;
+    int texture_width = level->width;
+    int texture_height = level->height;
+    int width_mask = level->width_mask;
+    int height_mask = level->height_mask;
+    int min_texel = level->min_texel;
+    int max_texel_x = level->max_texel_x;
+    int max_texel_y = level->max_texel_y;
+    const uint32_t* decoded_block = NULL;
+    uint32_t palette[4];
+    int fragments = 0;
+
+    for (int x = x_start; x < x_end; x++) {
+        float reciprocal_w = triangle_reciprocal_w_at(row_reciprocal_w, setup->reciprocal_w.dx, x);
+        float depth = 1.0 - reciprocal_w;
+        if (depth_test(depth, depth_row[x], raster_pass)) {
+            int tex_x = address_texel((int)floorf(u_over_w / reciprocal_w * texture_width), min_texel, max_texel_x, width_mask);
+            int tex_y = address_texel((int)floorf(v_over_w / reciprocal_w * texture_height), min_texel, max_texel_y, height_mask);
+
+            const uint32_t* block = level->texels + BC1_BLOCK_WORDS * (((tex_y >> 2) << level->tile_stride_shift) + (tex_x >> 2));
+            if (block != decoded_block) {
+                decode_bc1_palette(block, palette);
+                decoded_block = block;
+            }
+            color_row[x] = palette[bc1_texel_index(block, tex_x, tex_y)];
+
+            if (write_depth) depth_row[x] = depth;
+            fragments++;
+        }
+        u_over_w += setup->u_over_w.dx;
+        v_over_w += setup->v_over_w.dx;
+    }
+    return fragments;
+}
+
+DEFINE_SPAN_KERNELS(draw_bc1_span_scalar, )
+
+// Same as draw_textured_span_scalar() for a virtual level, whose texels are
+// looked up tile by tile in the virtual texture cache
+static SPAN_INLINE int draw_virtual_span_scalar(int y, int x_start, int x_end, const triangle_setup_t* setup, const int raster_pass){
+    const bool write_depth = raster_pass != RASTER_PASS_SHADE;
+    uint32_t* color_row = setup->target_buffer + y * get_window_width();
+    float* depth_row = get_z_buffer() + y * get_window_width();
+    float row_reciprocal_w = triangle_row_reciprocal_w(setup, y);
+    float u_over_w = triangle_gradient_at(setup->u_over_w, setup->point_a, x_start, y);
+    float v_over_w = triangle_gradient_at(setup->v_over_w, setup->point_a, x_start, y);
+
+    const texture_level_t* level = setup->texture_level;
+    int fragments = 0;
+
+    for (int x = x_start; x < x_end; x++) {
+        float reciprocal_w = triangle_reciprocal_w_at(row_reciprocal_w, setup->reciprocal_w.dx, x);
+        float depth = 1.0 - reciprocal_w;
+        if (depth_test(depth, depth_row[x], raster_pass)) {
+            int tex_x = address_texel((int)floorf(u_over_w / reciprocal_w * level->width), level->min_texel, level->max_texel_x, level->width_mask);
+            int tex_y = address_texel((int)floorf(v_over_w / reciprocal_w * level->height), level->min_texel, level->max_texel_y, level->height_mask);
+            color_row[x] = fetch_virtual_texel(level, tex_x, tex_y);
+            if (write_depth) depth_row[x] = depth;
+            fragments++;
+        }
+        u_over_w += setup->u_over_w.dx;
+        v_over_w += setup->v_over_w.dx;
+    }
+    return fragments;
+}
+
+DEFINE_SPAN_KERNELS(draw_virtual_span_scalar, )
+
+///////////////////////////////////////////////////////////////////////////////
+// Affine subdivision kernel
+///////////////////////////////////////////////////////////////////////////////
+// Instead of dividing u/w and v/w by 1/w for every pixel, the exact
+// perspective-correct texture coordinates are computed only every
+// affine_span_length pixels and interpolated linearly in between. Depth is
+// still exact per pixel. Shorter runs are closer to the exact kernel, longer
+// runs do fewer divides.
+//
+// With stats printing on, every pixel is also sampled the exact way and the
+// difference is recorded: how many pixels fetched a different texel and the
+// largest distance (in texels) between the two fetches.
+///////////////////////////////////////////////////////////////////////////////
+static SPAN_INLINE int draw_textured_span_affine(int y, int x_start, int x_end, const triangle_setup_t* setup, const int raster_pass){
+    const bool write_depth = raster_pass != RASTER_PASS_SHADE;
+    uint32_t* color_row = setup->target_buffer + y * get_window_width();
+    float* depth_row = get_z_buffer() + y * get_window_width();
+    const texture_level_t* level = setup->texture_level;
+    const uint32_t* texture_buffer = level->texels;
+    int texture_width = level->width;
+    int texture_height = level->height;
+    int width_mask = level->width_mask;
+    int height_mask = level->height_mask;
+    int min_texel = level->min_texel;
+    int max_texel_x = level->max_texel_x;
+    int max_texel_y = level->max_texel_y;
+
+    float row_reciprocal_w = triangle_row_reciprocal_w(setup, y);
+    float u_over_w = triangle_gradient_at(setup->u_over_w, setup->point_a, x_start, y);
+    float v_over_w = triangle_gradient_at(setup->v_over_w, setup->point_a, x_start, y);
+
+    bool measure_error = is_stats_printing();
+    int fragments = 0;
+    int texel_misses = 0;
+    int max_texel_error = 0;
+
+    // Exact texture coordinates (in texels) at the start of the first run
+    float w = 1 / triangle_reciprocal_w_at(row_reciprocal_w, setup->reciprocal_w.dx, x_start);
+    float tex_u = u_over_w * w * texture_width;
+    float tex_v = v_over_w * w * texture_height;
+
+    for (int x = x_start; x < x_end; ) {
+        int run_length = x_end - x < affine_span_length ? x_end - x : affine_span_length;
+
+        // Exact texture coordinates at the end of this run, one divide per run
+        float end_reciprocal_w = triangle_reciprocal_w_at(row_reciprocal_w, setup->reciprocal_w.dx, x + run_length);
+        float end_u_over_w = u_over_w + setup->u_over_w.dx * run_length;
+        float end_v_over_w = v_over_w + setup->v_over_w.dx * run_length;
+        float end_w = 1 / end_reciprocal_w;
+        float end_tex_u = end_u_over_w * end_w * texture_width;
+        float end_tex_v = end_v_over_w * end_w * texture_height;
+
+        float tex_u_step = (end_tex_u - tex_u) / run_length;
+        float tex_v_step = (end_tex_v - tex_v) / run_length;
+
+        for (int run_end = x + run_length; x < run_end; x++) {
+            float reciprocal_w = triangle_reciprocal_w_at(row_reciprocal_w, setup->reciprocal_w.dx, x);
+            float depth = 1.0 - reciprocal_w;
+            if (depth_test(depth, depth_row[x], raster_pass)) {
+                int tex_x = address_texel((int)floorf(tex_u), min_texel, max_texel_x, width_mask);
+                int tex_y = address_texel((int)floorf(tex_v), min_texel, max_texel_y, height_mask);
+                color_row[x] = texture_buffer[texel_offset(level, tex_x, tex_y)];
+                if (write_depth) depth_row[x] = depth;
+                fragments++;
+
+                if (measure_error) {
+                    int exact_x = address_texel((int)floorf(u_over_w / reciprocal_w * texture_width), min_texel, max_texel_x, width_mask);
+                    int exact_y = address_texel((int)floorf(v_over_w / reciprocal_w * texture_height), min_texel, max_texel_y, height_mask);
+                    // Distance on the wrapped texture, so 0 and width - 1 are neighbours
+                    int error_x = abs(exact_x - tex_x);
+                    int error_y = abs(exact_y - tex_y);
+                    if (error_x > texture_width / 2) error_x = texture_width - error_x;
+                    if (error_y > texture_height / 2) error_y = texture_height - error_y;
+                    int texel_error = error_x + error_y;
+                    if (texel_error > 0) texel_misses++;
+                    if (texel_error > max_texel_error) max_texel_error = texel_error;
+                }
+            }
+            u_over_w += setup->u_over_w.dx;
+            v_over_w += setup->v_over_w.dx;
+            tex_u += tex_u_step;
+            tex_v += tex_v_step;
+        }
+
+        // Snap back to the exact values so the error does not accumulate
+        tex_u = end_tex_u;
+        tex_v = end_tex_v;
+    }
+
+    if (measure_error) {
+        add_stat(STAT_AFFINE_PIXELS, fragments);
+        add_stat(STAT_AFFINE_TEXEL_MISSES, texel_misses);
+        max_stat(STAT_AFFINE_MAX_TEXEL_ERROR, max_texel_error);
+    }
+    return fragments;
+}
+
+DEFINE_SPAN_KERNELS(draw_textured_span_affine, )
+
+#ifdef SPAN_X86_KERNELS
+
+///////////////////////////////////////////////////////////////////////////////
+// SSE4.1 kernels, 4 pixels per iteration
+///////////////////////////////////////////////////////////////////////////////
+
+// texel_offset() for 4 lanes, with the level's tile parameters broadcast
+SPAN_TARGET("sse4.1")
+static SPAN_INLINE __m128i texel_offset_sse41(__m128i tex_x, __m128i tex_y, __m128i tile_shift, __m128i tile_stride_shift, __m128i tile_mask) {
+    __m128i tile = _mm_add_epi32(_mm_sll_epi32(_mm_srl_epi32(tex_y, tile_shift), tile_stride_shift), _mm_srl_epi32(tex_x, tile_shift));
+    __m128i inner = _mm_add_epi32(_mm_sll_epi32(_mm_and_si128(tex_y, tile_mask), tile_shift), _mm_and_si128(tex_x, tile_mask));
+    return _mm_add_epi32(_mm_sll_epi32(_mm_sll_epi32(tile, tile_shift), tile_shift), inner);
+}
+
+// address_texel() for 4 lanes
+SPAN_TARGET("sse4.1")
+static SPAN_INLINE __m128i address_texels_sse41(__m128i coordinate, __m128i min_texel, __m128i max_texel, __m128i mask) {
+    return _mm_and_si128(_mm_min_epi32(_mm_max_epi32(coordinate, min_texel), max_texel), mask);
+}
+
+SPAN_TARGET("sse4.1")
+static SPAN_INLINE int draw_flat_span_sse41(int y, int x_start, int x_end, const triangle_setup_t* setup, const int raster_pass){
+    const bool write_color = raster_pass != RASTER_PASS_DEPTH;
+    const bool write_depth = raster_pass != RASTER_PASS_SHADE;
+    uint32_t* color_row = setup->target_buffer + y * get_window_width();
+    float* depth_row = get_z_buffer() + y * get_window_width();
+
+    float reciprocal_w_dx = setup->reciprocal_w.dx;
+    float row_reciprocal_w = triangle_row_reciprocal_w(setup, y);
+
+    __m128 lane = _mm_set_ps(3, 2, 1, 0);
+    __m128 one = _mm_set1_ps(1.0f);
+    __m128 row_reciprocal_w_lanes = _mm_set1_ps(row_reciprocal_w);
+    __m128 reciprocal_w_dx_lanes = _mm_set1_ps(reciprocal_w_dx);
+    __m128 pixel_x = _mm_add_ps(_mm_set1_ps((float)x_start), lane);
+    __m128 pixel_x_step = _mm_set1_ps(4.0f);
+    __m128i color = _mm_set1_epi32(setup->color);
+    int fragments = 0;
+
+    int x = x_start;
+    for (; x + 4 <= x_end; x += 4) {
+        __m128 reciprocal_w = _mm_add_ps(row_reciprocal_w_lanes, _mm_mul_ps(pixel_x, reciprocal_w_dx_lanes));
+        __m128 depth = _mm_sub_ps(one, reciprocal_w);
+        __m128 stored_depth = _mm_loadu_ps(depth_row + x);
+        __m128 pass = raster_pass == RASTER_PASS_SHADE ? _mm_cmple_ps(depth, stored_depth) : _mm_cmplt_ps(depth, stored_depth);
+
+        int pass_bits = _mm_movemask_ps(pass);
+        if (pass_bits) {
+            fragments += __builtin_popcount(pass_bits);
+            if (write_color) {
+                __m128i old_color = _mm_loadu_si128((__m128i*)(color_row + x));
+                _mm_storeu_si128((__m128i*)(color_row + x), _mm_blendv_epi8(old_color, color, _mm_castps_si128(pass)));
+            }
+            if (write_depth) {
+                _mm_storeu_ps(depth_row + x, _mm_blendv_ps(stored_depth, depth, pass));
+            }
+        }
+        pixel_x = _mm_add_ps(pixel_x, pixel_x_step);
+    }
+
+    // Finish the last few pixels one at a time
+    for (; x < x_end; x++) {
+        float reciprocal_w_tail = triangle_reciprocal_w_at(row_reciprocal_w, reciprocal_w_dx, x);
+        float depth = 1.0 - reciprocal_w_tail;
+        if (depth_test(depth, depth_row[x], raster_pass)) {
+            if (write_color) color_row[x] = setup->color;
+            if (write_depth) depth_row[x] = depth;
+            fragments++;
+        }
+    }
+    return fragments;
+}
+
+DEFINE_SPAN_KERNELS(draw_flat_span_sse41, SPAN_TARGET("sse4.1"))
+
+SPAN_TARGET("sse4.1")
+static SPAN_INLINE int draw_textured_span_sse41(int y, int x_start, int x_end, const triangle_setup_t* setup, const int raster_pass){
+    const bool write_depth = raster_pass != RASTER_PASS_SHADE;
+    uint32_t* color_row = setup->target_buffer + y * get_window_width();
+    float* depth_row = get_z_buffer() + y * get_window_width();
+    const texture_level_t* level = setup->texture_level;
+    const uint32_t* texture_buffer = level->texels;
+    int texture_width = level->width;
+    int texture_height = level->height;
+    int width_mask = level->width_mask;
+    int height_mask = level->height_mask;
+    int min_texel = level->min_texel;
+    int max_texel_x = level->max_texel_x;
+    int max_texel_y = level->max_texel_y;
+
+    float reciprocal_w_dx = setup->reciprocal_w.dx;
+    float u_over_w_dx = setup->u_over_w.dx;
+    float v_over_w_dx = setup->v_over_w.dx;
+    float row_reciprocal_w = triangle_row_reciprocal_w(setup, y);
+    float u_over_w_start = triangle_gradient_at(setup->u_over_w, setup->point_a, x_start, y);
+    float v_over_w_start = triangle_gradient_at(setup->v_over_w, setup->point_a, x_start, y);
+
+    __m128 lane = _mm_set_ps(3, 2, 1, 0);
+    __m128 one = _mm_set1_ps(1.0f);
+    __m128 row_reciprocal_w_lanes = _mm_set1_ps(row_reciprocal_w);
+    __m128 reciprocal_w_dx_lanes = _mm_set1_ps(reciprocal_w_dx);
+    __m128 pixel_x = _mm_add_ps(_mm_set1_ps((float)x_start), lane);
+    __m128 u_over_w = _mm_add_ps(_mm_set1_ps(u_over_w_start), _mm_mul_ps(lane, _mm_set1_ps(u_over_w_dx)));
+    __m128 v_over_w = _mm_add_ps(_mm_set1_ps(v_over_w_start), _mm_mul_ps(lane, _mm_set1_ps(v_over_w_dx)));
+    __m128 pixel_x_step = _mm_set1_ps(4.0f);
+    __m128 u_over_w_step = _mm_set1_ps(u_over_w_dx * 4);
+    __m128 v_over_w_step = _mm_set1_ps(v_over_w_dx * 4);
+
+    __m128 width_f = _mm_set1_ps((float)texture_width);
+    __m128 height_f = _mm_set1_ps((float)texture_height);
+    __m128i width_mask_lanes = _mm_set1_epi32(width_mask);
+    __m128i height_mask_lanes = _mm_set1_epi32(height_mask);
+    __m128i min_texel_lanes = _mm_set1_epi32(min_texel);
+    __m128i max_texel_x_lanes = _mm_set1_epi32(max_texel_x);
+    __m128i max_texel_y_lanes = _mm_set1_epi32(max_texel_y);
+    __m128i tile_shift = _mm_cvtsi32_si128(level->tile_shift);
+    __m128i tile_stride_shift = _mm_cvtsi32_si128(level->tile_stride_shift);
+    __m128i tile_mask = _mm_set1_epi32((1 << level->tile_shift) - 1);
+    int fragments = 0;
+
+    int x = x_start;
+    for (; x + 4 <= x_end; x += 4) {
+        __m128 reciprocal_w = _mm_add_ps(row_reciprocal_w_lanes, _mm_mul_ps(pixel_x, reciprocal_w_dx_lanes));
+        __m128 depth = _mm_sub_ps(one, reciprocal_w);
+        __m128 stored_depth = _mm_loadu_ps(depth_row + x);
+        __m128 pass = raster_pass == RASTER_PASS_SHADE ? _mm_cmple_ps(depth, stored_depth) : _mm_cmplt_ps(depth, stored_depth);
+
+        int pass_bits = _mm_movemask_ps(pass);
+        if (pass_bits) {
+            fragments += __builtin_popcount(pass_bits);
+            // Perspective divide: one reciprocal shared by u and v
+            __m128 w = _mm_div_ps(one, reciprocal_w);
+            __m128 u = _mm_mul_ps(u_over_w, w);
+            __m128 v = _mm_mul_ps(v_over_w, w);
+
+            // Power-of-two sizes: wrapping is a single AND per axis
+            __m128i tex_x = address_texels_sse41(_mm_cvttps_epi32(_mm_floor_ps(_mm_mul_ps(u, width_f))), min_texel_lanes, max_texel_x_lanes, width_mask_lanes);
+            __m128i tex_y = address_texels_sse41(_mm_cvttps_epi32(_mm_floor_ps(_mm_mul_ps(v, height_f))), min_texel_lanes, max_texel_y_lanes, height_mask_lanes);
+
+            // Lanes that failed the depth test fetch texel 0 instead of a wild address
+            __m128i texel_index = texel_offset_sse41(tex_x, tex_y, tile_shift, tile_stride_shift, tile_mask);
+            texel_index = _mm_and_si128(texel_index, _mm_castps_si128(pass));
+
+            __m128i texel = _mm_set_epi32(
+                texture_buffer[_mm_extract_epi32(texel_index, 3)],
+                texture_buffer[_mm_extract_epi32(texel_index, 2)],
+                texture_buffer[_mm_extract_epi32(texel_index, 1)],
+                texture_buffer[_mm_extract_epi32(texel_index, 0)]
+            );
+
+            __m128i old_color = _mm_loadu_si128((__m128i*)(color_row + x));
+            _mm_storeu_si128((__m128i*)(color_row + x), _mm_blendv_epi8(old_color, texel, _mm_castps_si128(pass)));
+            if (write_depth) {
+                _mm_storeu_ps(depth_row + x, _mm_blendv_ps(stored_depth, depth, pass));
+            }
+        }
+        pixel_x = _mm_add_ps(pixel_x, pixel_x_step);
+        u_over_w = _mm_add_ps(u_over_w, u_over_w_step);
+        v_over_w = _mm_add_ps(v_over_w, v_over_w_step);
+    }
+
+    // Finish the last few pixels one at a time
+    float u_over_w_tail = _mm_cvtss_f32(u_over_w);
+    float v_over_w_tail = _mm_cvtss_f32(v_over_w);
+    for (; x < x_end; x++) {
+        float reciprocal_w_tail = triangle_reciprocal_w_at(row_reciprocal_w, reciprocal_w_dx, x);
+        float depth = 1.0 - reciprocal_w_tail;
+        if (depth_test(depth, depth_row[x], raster_pass)) {
+            int tex_x = address_texel((int)floorf(u_over_w_tail / reciprocal_w_tail * texture_width), min_texel, max_texel_x, width_mask);
+            int tex_y = address_texel((int)floorf(v_over_w_tail / reciprocal_w_tail * texture_height), min_texel, max_texel_y, height_mask);
+            color_row[x] = texture_buffer[texel_offset(level, tex_x, tex_y)];
+            if (write_depth) depth_row[x] = depth;
+            fragments++;
+        }
+        u_over_w_tail += u_over_w_dx;
+        v_over_w_tail += v_over_w_dx;
+    }
+    return fragments;
+}
+
+DEFINE_SPAN_KERNELS(draw_textured_span_sse41, SPAN_TARGET("sse4.1"))
+
+///////////////////////////////////////////////////////////////////////////////
+// SSE4.1 bilinear kernel
+///////////////////////////////////////////////////////////////////////////////
+// Each pixel blends the 2x2 texels around its sample point. The four corner
+// texels of 4 pixels are fetched into four registers, then widened to 16 bits
+// per channel so one multiply weights all channels of two pixels at once:
+//
+//     lerp(a, b, w) = (a * (256 - w) + b * w) >> 8,   w in [0, 255]
+//
+// Both products fit in 16 bits and so does their sum, and the rounding is
+// the same as sample_texture_bilinear(); pixels only differ from the scalar
+// kernel where the texture coordinate itself rounds differently.
+///////////////////////////////////////////////////////////////////////////////
+
+// Blend 4 texel pairs with per-pixel weights (one 32-bit lane per pixel)
+SPAN_TARGET("sse4.1")
+static SPAN_INLINE __m128i lerp_texels_sse41(__m128i a, __m128i b, __m128i weight) {
+    // Copy the weight of each pixel to the 16-bit lanes of its four channels
+    const __m128i spread_low = _mm_setr_epi8(0, 1, 0, 1, 0, 1, 0, 1, 4, 5, 4, 5, 4, 5, 4, 5);
+    const __m128i spread_high = _mm_setr_epi8(8, 9, 8, 9, 8, 9, 8, 9, 12, 13, 12, 13, 12, 13, 12, 13);
+    __m128i zero = _mm_setzero_si128();
+    __m128i inverse = _mm_sub_epi32(_mm_set1_epi32(256), weight);
+
+    __m128i low = _mm_add_epi16(
+        _mm_mullo_epi16(_mm_unpacklo_epi8(a, zero), _mm_shuffle_epi8(inverse, spread_low)),
+        _mm_mullo_epi16(_mm_unpacklo_epi8(b, zero), _mm_shuffle_epi8(weight, spread_low))
+    );
+    __m128i high = _mm_add_epi16(
+        _mm_mullo_epi16(_mm_unpackhi_epi8(a, zero), _mm_shuffle_epi8(inverse, spread_high)),
+        _mm_mullo_epi16(_mm_unpackhi_epi8(b, zero), _mm_shuffle_epi8(weight, spread_high))
+    );
+    return _mm_packus_epi16(_mm_srli_epi16(low, 8), _mm_srli_epi16(high, 8));
+}
+
+// texel_offset() splits into a column part and a row part, so the four
+// corners cost two of each plus four adds
+SPAN_TARGET("sse4.1")
+static SPAN_INLINE __m128i texel_column_sse41(__m128i tex_x, __m128i tile_shift, __m128i tile_area_shift, __m128i tile_mask) {
+    return _mm_add_epi32(_mm_sll_epi32(_mm_srl_epi32(tex_x, tile_shift), tile_area_shift), _mm_and_si128(tex_x, tile_mask));
+}
+
+SPAN_TARGET("sse4.1")
+static SPAN_INLINE __m128i texel_row_sse41(__m128i tex_y, __m128i tile_shift, __m128i tile_row_shift, __m128i tile_mask) {
+    return _mm_add_epi32(_mm_sll_epi32(_mm_srl_epi32(tex_y, tile_shift), tile_row_shift), _mm_sll_epi32(_mm_and_si128(tex_y, tile_mask), tile_shift));
+}
+
+SPAN_TARGET("sse4.1")
+static SPAN_INLINE __m128i fetch_texels_sse41(const uint32_t* texels, __m128i offset) {
+    return _mm_set_epi32(
+        texels[_mm_extract_epi32(offset, 3)],
+        texels[_mm_extract_epi32(offset, 2)],
+        texels[_mm_extract_epi32(offset, 1)],
+        texels[_mm_extract_epi32(offset, 0)]
+    );
+}
+
+SPAN_TARGET("sse4.1")
+static SPAN_INLINE int draw_bilinear_span_sse41(int y, int x_start, int x_end, const triangle_setup_t* setup, const int raster_pass){
+    const bool write_depth = raster_pass != RASTER_PASS_SHADE;
+    uint32_t* color_row = setup->target_buffer + y * get_window_width();
+    float* depth_row = get_z_buffer() + y * get_window_width();
+    const texture_level_t* level = setup->texture_level;
+    const uint32_t* texture_buffer = level->texels;
+
+    float reciprocal_w_dx = setup->reciprocal_w.dx;
+    float u_over_w_dx = setup->u_over_w.dx;
+    float v_over_w_dx = setup->v_over_w.dx;
+    float row_reciprocal_w = triangle_row_reciprocal_w(setup, y);
+    float u_over_w_start = triangle_gradient_at(setup->u_over_w, setup->point_a, x_start, y);
+    float v_over_w_start = triangle_gradient_at(setup->v_over_w, setup->point_a, x_start, y);
+
+    __m128 lane = _mm_set_ps(3, 2, 1, 0);
+    __m128 one = _mm_set1_ps(1.0f);
+    __m128 row_reciprocal_w_lanes = _mm_set1_ps(row_reciprocal_w);
+    __m128 reciprocal_w_dx_lanes = _mm_set1_ps(reciprocal_w_dx);
+    __m128 pixel_x = _mm_add_ps(_mm_set1_ps((float)x_start), lane);
+    __m128 u_over_w = _mm_add_ps(_mm_set1_ps(u_over_w_start), _mm_mul_ps(lane, _mm_set1_ps(u_over_w_dx)));
+    __m128 v_over_w = _mm_add_ps(_mm_set1_ps(v_over_w_start), _mm_mul_ps(lane, _mm_set1_ps(v_over_w_dx)));
+    __m128 pixel_x_step = _mm_set1_ps(4.0f);
+    __m128 u_over_w_step = _mm_set1_ps(u_over_w_dx * 4);
+    __m128 v_over_w_step = _mm_set1_ps(v_over_w_dx * 4);
+
+    __m128 width_f = _mm_set1_ps((float)level->width);
+    __m128 height_f = _mm_set1_ps((float)level->height);
+    __m128 half = _mm_set1_ps(0.5f);
+    __m128 weight_scale = _mm_set1_ps(256.0f);
+    __m128i one_texel = _mm_set1_epi32(1);
+    __m128i width_mask = _mm_set1_epi32(level->width_mask);
+    __m128i height_mask = _mm_set1_epi32(level->height_mask);
+    __m128i min_texel = _mm_set1_epi32(level->min_texel);
+    __m128i max_texel_x = _mm_set1_epi32(level->max_texel_x);
+    __m128i max_texel_y = _mm_set1_epi32(level->max_texel_y);
+    __m128i tile_shift = _mm_cvtsi32_si128(level->tile_shift);
+    __m128i tile_area_shift = _mm_cvtsi32_si128(2 * level->tile_shift);
+    __m128i tile_row_shift = _mm_cvtsi32_si128(2 * level->tile_shift + level->tile_stride_shift);
+    __m128i tile_mask = _mm_set1_epi32((1 << level->tile_shift) - 1);
+    int fragments = 0;
+
+    int x = x_start;
+    for (; x + 4 <= x_end; x += 4) {
+        __m128 reciprocal_w = _mm_add_ps(row_reciprocal_w_lanes, _mm_mul_ps(pixel_x, reciprocal_w_dx_lanes));
+        __m128 depth = _mm_sub_ps(one, reciprocal_w);
+        __m128 stored_depth = _mm_loadu_ps(depth_row + x);
+        __m128 pass = raster_pass == RASTER_PASS_SHADE ? _mm_cmple_ps(depth, stored_depth) : _mm_cmplt_ps(depth, stored_depth);
+
+        int pass_bits = _mm_movemask_ps(pass);
+        if (pass_bits) {
+            fragments += __builtin_popcount(pass_bits);
+            __m128 w = _mm_div_ps(one, reciprocal_w);
+
+            // Texel centers sit at half-integer coordinates
+            __m128 tex_u = _mm_sub_ps(_mm_mul_ps(_mm_mul_ps(u_over_w, w), width_f), half);
+            __m128 tex_v = _mm_sub_ps(_mm_mul_ps(_mm_mul_ps(v_over_w, w), height_f), half);
+            __m128 floor_u = _mm_floor_ps(tex_u);
+            __m128 floor_v = _mm_floor_ps(tex_v);
+            __m128i weight_x = _mm_cvttps_epi32(_mm_mul_ps(_mm_sub_ps(tex_u, floor_u), weight_scale));
+            __m128i weight_y = _mm_cvttps_epi32(_mm_mul_ps(_mm_sub_ps(tex_v, floor_v), weight_scale));
+
+            __m128i column = _mm_cvttps_epi32(floor_u);
+            __m128i row = _mm_cvttps_epi32(floor_v);
+            __m128i x0 = address_texels_sse41(column, min_texel, max_texel_x, width_mask);
+            __m128i y0 = address_texels_sse41(row, min_texel, max_texel_y, height_mask);
+            __m128i x1 = address_texels_sse41(_mm_add_epi32(column, one_texel), min_texel, max_texel_x, width_mask);
+            __m128i y1 = address_texels_sse41(_mm_add_epi32(row, one_texel), min_texel, max_texel_y, height_mask);
+
+            // Lanes that failed the depth test fetch texel 0 instead of a wild address
+            __m128i pass_mask = _mm_castps_si128(pass);
+            __m128i column_0 = texel_column_sse41(x0, tile_shift, tile_area_shift, tile_mask);
+            __m128i column_1 = texel_column_sse41(x1, tile_shift, tile_area_shift, tile_mask);
+            __m128i row_0 = _mm_and_si128(texel_row_sse41(y0, tile_shift, tile_row_shift, tile_mask), pass_mask);
+            __m128i row_1 = _mm_and_si128(texel_row_sse41(y1, tile_shift, tile_row_shift, tile_mask), pass_mask);
+            column_0 = _mm_and_si128(column_0, pass_mask);
+            column_1 = _mm_and_si128(column_1, pass_mask);
+            __m128i texel_00 = fetch_texels_sse41(texture_buffer, _mm_add_epi32(row_0, column_0));
+            __m128i texel_10 = fetch_texels_sse41(texture_buffer, _mm_add_epi32(row_0, column_1));
+            __m128i texel_01 = fetch_texels_sse41(texture_buffer, _mm_add_epi32(row_1, column_0));
+            __m128i texel_11 = fetch_texels_sse41(texture_buffer, _mm_add_epi32(row_1, column_1));
+
+            __m128i top = lerp_texels_sse41(texel_00, texel_10, weight_x);
+            __m128i bottom = lerp_texels_sse41(texel_01, texel_11, weight_x);
+            __m128i texel = lerp_texels_sse41(top, bottom, weight_y);
+
+            __m128i old_color = _mm_loadu_si128((__m128i*)(color_row + x));
+            _mm_storeu_si128((__m128i*)(color_row + x), _mm_blendv_epi8(old_color, texel, pass_mask));
+            if (write_depth) {
+                _mm_storeu_ps(depth_row + x, _mm_blendv_ps(stored_depth, depth, pass));
+            }
+        }
+        pixel_x = _mm_add_ps(pixel_x, pixel_x_step);
+        u_over_w = _mm_add_ps(u_over_w, u_over_w_step);
+        v_over_w = _mm_add_ps(v_over_w, v_over_w_step);
+    }
+
+    // Finish the last few pixels one at a time
+    float u_over_w_tail = _mm_cvtss_f32(u_over_w);
+    float v_over_w_tail = _mm_cvtss_f32(v_over_w);
+    for (; x < x_end; x++) {
+        float reciprocal_w_tail = triangle_reciprocal_w_at(row_reciprocal_w, reciprocal_w_dx, x);
+        float depth = 1.0 - reciprocal_w_tail;
+        if (depth_test(depth, depth_row[x], raster_pass)) {
+            color_row[x] = sample_texture_bilinear(level, u_over_w_tail / reciprocal_w_tail, v_over_w_tail / reciprocal_w_tail);
+            if (write_depth) depth_row[x] = depth;
+            fragments++;
+        }
+        u_over_w_tail += u_over_w_dx;
+        v_over_w_tail += v_over_w_dx;
+    }
+    return fragments;
+}
+
+DEFINE_SPAN_KERNELS(draw_bilinear_span_sse41, SPAN_TARGET("sse4.1"))
+
+///////////////////////////////////////////////////////////////////////////////
+// AVX2 kernels, 8 pixels per iteration with hardware texel gather
+///////////////////////////////////////////////////////////////////////////////
+
+SPAN_TARGET("avx2")
+static SPAN_INLINE __m256i texel_offset_avx2(__m256i tex_x, __m256i tex_y, __m128i tile_shift, __m128i tile_stride_shift, __m256i tile_mask) {
+    __m256i tile = _mm256_add_epi32(_mm256_sll_epi32(_mm256_srl_epi32(tex_y, tile_shift), tile_stride_shift), _mm256_srl_epi32(tex_x, tile_shift));
+    __m256i inner = _mm256_add_epi32(_mm256_sll_epi32(_mm256_and_si256(tex_y, tile_mask), tile_shift), _mm256_and_si256(tex_x, tile_mask));
+    return _mm256_add_epi32(_mm256_sll_epi32(_mm256_sll_epi32(tile, tile_shift), tile_shift), inner);
+}
+
+// address_texel() for 8 lanes
+SPAN_TARGET("avx2")
+static SPAN_INLINE __m256i address_texels_avx2(__m256i coordinate, __m256i min_texel, __m256i max_texel, __m256i mask) {
+    return _mm256_and_si256(_mm256_min_epi32(_mm256_max_epi32(coordinate, min_texel), max_texel), mask);
+}
+
+SPAN_TARGET("avx2")
+static SPAN_INLINE int draw_flat_span_avx2(int y, int x_start, int x_end, const triangle_setup_t* setup, const int raster_pass){
+    const bool write_color = raster_pass != RASTER_PASS_DEPTH;
+    const bool write_depth = raster_pass != RASTER_PASS_SHADE;
+    uint32_t* color_row = setup->target_buffer + y * get_window_width();
+    float* depth_row = get_z_buffer() + y * get_window_width();
+
+    float reciprocal_w_dx = setup->reciprocal_w.dx;
+    float row_reciprocal_w = triangle_row_reciprocal_w(setup, y);
+
+    __m256 lane = _mm256_set_ps(7, 6, 5, 4, 3, 2, 1, 0);
+    __m256 one = _mm256_set1_ps(1.0f);
+    __m256 row_reciprocal_w_lanes = _mm256_set1_ps(row_reciprocal_w);
+    __m256 reciprocal_w_dx_lanes = _mm256_set1_ps(reciprocal_w_dx);
+    __m256 pixel_x = _mm256_add_ps(_mm256_set1_ps((float)x_start), lane);
+    __m256 pixel_x_step = _mm256_set1_ps(8.0f);
+    __m256i color = _mm256_set1_epi32(setup->color);
+    int fragments = 0;
+
+    int x = x_start;
+    for (; x + 8 <= x_end; x += 8) {
+        __m256 reciprocal_w = _mm256_add_ps(row_reciprocal_w_lanes, _mm256_mul_ps(pixel_x, reciprocal_w_dx_lanes));
+        __m256 depth = _mm256_sub_ps(one, reciprocal_w);
+        __m256 stored_depth = _mm256_loadu_ps(depth_row + x);
+        __m256 pass = raster_pass == RASTER_PASS_SHADE ?
+            _mm256_cmp_ps(depth, stored_depth, _CMP_LE_OQ) : _mm256_cmp_ps(depth, stored_depth, _CMP_LT_OQ);
+
+        int pass_bits = _mm256_movemask_ps(pass);
+        if (pass_bits) {
+            fragments += __builtin_popcount(pass_bits);
+            if (write_color) {
+                __m256i old_color = _mm256_loadu_si256((__m256i*)(color_row + x));
+                _mm256_storeu_si256((__m256i*)(color_row + x), _mm256_blendv_epi8(old_color, color, _mm256_castps_si256(pass)));
+            }
+            if (write_depth) {
+                _mm256_storeu_ps(depth_row + x, _mm256_blendv_ps(stored_depth, depth, pass));
+            }
+        }
+        pixel_x = _mm256_add_ps(pixel_x, pixel_x_step);
+    }
+
+    // Finish the last few pixels one at a time
+    for (; x < x_end; x++) {
+        float reciprocal_w_tail = triangle_reciprocal_w_at(row_reciprocal_w, reciprocal_w_dx, x);
+        float depth = 1.0 - reciprocal_w_tail;
+        if (depth_test(depth, depth_row[x], raster_pass)) {
+            if (write_color) color_row[x] = setup->color;
+            if (write_depth) depth_row[x] = depth;
+            fragments++;
+        }
+    }
+    return fragments;
+}
+
+DEFINE_SPAN_KERNELS(draw_flat_span_avx2, SPAN_TARGET("avx2"))
+
+SPAN_TARGET("avx2")
+static SPAN_INLINE int draw_textured_span_avx2(int y, int x_start, int x_end, const triangle_setup_t* setup, const int raster_pass){
+    const bool write_depth = raster_pass != RASTER_PASS_SHADE;
+    uint32_t* color_row = setup->target_buffer + y * get_window_width();
+    float* depth_row = get_z_buffer() + y * get_window_width();
+    const texture_level_t* level = setup->texture_level;
+    const uint32_t* texture_buffer = level->texels;
+    int texture_width = level->width;
+    int texture_height = level->height;
+    int width_mask = level->width_mask;
+    int height_mask = level->height_mask;
+    int min_texel = level->min_texel;
+    int max_texel_x = level->max_texel_x;
+    int max_texel_y = level->max_texel_y;
+
+    float reciprocal_w_dx = setup->reciprocal_w.dx;
+    float u_over_w_dx = setup->u_over_w.dx;
+    float v_over_w_dx = setup->v_over_w.dx;
+    float row_reciprocal_w = triangle_row_reciprocal_w(setup, y);
+    float u_over_w_start = triangle_gradient_at(setup->u_over_w, setup->point_a, x_start, y);
+    float v_over_w_start = triangle_gradient_at(setup->v_over_w, setup->point_a, x_start, y);
+
+    __m256 lane = _mm256_set_ps(7, 6, 5, 4, 3, 2, 1, 0);
+    __m256 one = _mm256_set1_ps(1.0f);
+    __m256 row_reciprocal_w_lanes = _mm256_set1_ps(row_reciprocal_w);
+    __m256 reciprocal_w_dx_lanes = _mm256_set1_ps(reciprocal_w_dx);
+    __m256 pixel_x = _mm256_add_ps(_mm256_set1_ps((float)x_start), lane);
+    __m256 u_over_w = _mm256_add_ps(_mm256_set1_ps(u_over_w_start), _mm256_mul_ps(lane, _mm256_set1_ps(u_over_w_dx)));
+    __m256 v_over_w = _mm256_add_ps(_mm256_set1_ps(v_over_w_start), _mm256_mul_ps(lane, _mm256_set1_ps(v_over_w_dx)));
+    __m256 pixel_x_step = _mm256_set1_ps(8.0f);
+    __m256 u_over_w_step = _mm256_set1_ps(u_over_w_dx * 8);
+    __m256 v_over_w_step = _mm256_set1_ps(v_over_w_dx * 8);
+
+    __m256 width_f = _mm256_set1_ps((float)texture_width);
+    __m256 height_f = _mm256_set1_ps((float)texture_height);
+    __m256i width_mask_lanes = _mm256_set1_epi32(width_mask);
+    __m256i height_mask_lanes = _mm256_set1_epi32(height_mask);
+    __m256i min_texel_lanes = _mm256_set1_epi32(min_texel);
+    __m256i max_texel_x_lanes = _mm256_set1_epi32(max_texel_x);
+    __m256i max_texel_y_lanes = _mm256_set1_epi32(max_texel_y);
+    __m128i tile_shift = _mm_cvtsi32_si128(level->tile_shift);
+    __m128i tile_stride_shift = _mm_cvtsi32_si128(level->tile_stride_shift);
+    __m256i tile_mask = _mm256_set1_epi32((1 << level->tile_shift) - 1);
+    int fragments = 0;
+
+    int x = x_start;
+    for (; x + 8 <= x_end; x += 8) {
+        __m256 reciprocal_w = _mm256_add_ps(row_reciprocal_w_lanes, _mm256_mul_ps(pixel_x, reciprocal_w_dx_lanes));
+        __m256 depth = _mm256_sub_ps(one, reciprocal_w);
+        __m256 stored_depth = _mm256_loadu_ps(depth_row + x);
+        __m256 pass = raster_pass == RASTER_PASS_SHADE ?
+            _mm256_cmp_ps(depth, stored_depth, _CMP_LE_OQ) : _mm256_cmp_ps(depth, stored_depth, _CMP_LT_OQ);
+
+        int pass_bits = _mm256_movemask_ps(pass);
+        if (pass_bits) {
+            fragments += __builtin_popcount(pass_bits);
+            // Perspective divide: one reciprocal shared by u and v
+            __m256 w = _mm256_div_ps(one, reciprocal_w);
+            __m256 u = _mm256_mul_ps(u_over_w, w);
+            __m256 v = _mm256_mul_ps(v_over_w, w);
+
+            // Power-of-two sizes: wrapping is a single AND per axis
+            __m256i tex_x = address_texels_avx2(_mm256_cvttps_epi32(_mm256_floor_ps(_mm256_mul_ps(u, width_f))), min_texel_lanes, max_texel_x_lanes, width_mask_lanes);
+            __m256i tex_y = address_texels_avx2(_mm256_cvttps_epi32(_mm256_floor_ps(_mm256_mul_ps(v, height_f))), min_texel_lanes, max_texel_y_lanes, height_mask_lanes);
+            __m256i texel_index = texel_offset_avx2(tex_x, tex_y, tile_shift, tile_stride_shift, tile_mask);
+
+            // Only lanes that passed the depth test touch texture memory
+            __m256i pass_mask = _mm256_castps_si256(pass);
+            __m256i old_color = _mm256_loadu_si256((__m256i*)(color_row + x));
+            __m256i color = _mm256_mask_i32gather_epi32(old_color, (const int*)texture_buffer, texel_index, pass_mask, 4);
+
+            _mm256_storeu_si256((__m256i*)(color_row + x), color);
+            if (write_depth) {
+                _mm256_storeu_ps(depth_row + x, _mm256_blendv_ps(stored_depth, depth, pass));
+            }
+        }
+        pixel_x = _mm256_add_ps(pixel_x, pixel_x_step);
+        u_over_w = _mm256_add_ps(u_over_w, u_over_w_step);
+        v_over_w = _mm256_add_ps(v_over_w, v_over_w_step);
+    }
+
+    // Finish the last few pixels one at a time
+    float u_over_w_tail = _mm256_cvtss_f32(u_over_w);
+    float v_over_w_tail = _mm256_cvtss_f32(v_over_w);
+    for (; x < x_end; x++) {
+        float reciprocal_w_tail = triangle_reciprocal_w_at(row_reciprocal_w, reciprocal_w_dx, x);
+        float depth = 1.0 - reciprocal_w_tail;
+        if (depth_test(depth, depth_row[x], raster_pass)) {
+            int tex_x = address_texel((int)floorf(u_over_w_tail / reciprocal_w_tail * texture_width), min_texel, max_texel_x, width_mask);
+            int tex_y = address_texel((int)floorf(v_over_w_tail / reciprocal_w_tail * texture_height), min_texel, max_texel_y, height_mask);
+            color_row[x] = texture_buffer[texel_offset(level, tex_x, tex_y)];
+            if (write_depth) depth_row[x] = depth;
+            fragments++;
+        }
+        u_over_w_tail += u_over_w_dx;
+        v_over_w_tail += v_over_w_dx;
+    }
+    return fragments;
+}
+
+DEFINE_SPAN_KERNELS(draw_textured_span_avx2, SPAN_TARGET("avx2"))
+
+// Same as draw_bilinear_span_sse41(), 8 pixels per iteration. The AVX2
+// unpacks and packs work within each 128-bit half, which keeps the pixels of
+// the spread weights and of the packed result in order.
+SPAN_TARGET("avx2")
+static SPAN_INLINE __m256i lerp_texels_avx2(__m256i a, __m256i b, __m256i weight) {
+    const __m256i spread_low = _mm256_setr_epi8(
+        0, 1, 0, 1, 0, 1, 0, 1, 4, 5, 4, 5, 4, 5, 4, 5,
+        0, 1, 0, 1, 0, 1, 0, 1, 4, 5, 4, 5, 4, 5, 4, 5
+    );
+    const __m256i spread_high = _mm256_setr_epi8(
+        8, 9, 8, 9, 8, 9, 8, 9, 12, 13, 12, 13, 12, 13, 12, 13,
+        8, 9, 8, 9, 8, 9, 8, 9, 12, 13, 12, 13, 12, 13, 12, 13
+    );
+    __m256i zero = _mm256_setzero_si256();
+    __m256i inverse = _mm256_sub_epi32(_mm256_set1_epi32(256), weight);
+
+    __m256i low = _mm256_add_epi16(
+        _mm256_mullo_epi16(_mm256_unpacklo_epi8(a, zero), _mm256_shuffle_epi8(inverse, spread_low)),
+        _mm256_mullo_epi16(_mm256_unpacklo_epi8(b, zero), _mm256_shuffle_epi8(weight, spread_low))
+    );
+    __m256i high = _mm256_add_epi16(
+        _mm256_mullo_epi16(_mm256_unpackhi_epi8(a, zero), _mm256_shuffle_epi8(inverse, spread_high)),
+        _mm256_mullo_epi16(_mm256_unpackhi_epi8(b, zero), _mm256_shuffle_epi8(weight, spread_high))
+    );
+    return _mm256_packus_epi16(_mm256_srli_epi16(low, 8), _mm256_srli_epi16(high, 8));
+}
+
+SPAN_TARGET("avx2")
+static SPAN_INLINE __m256i texel_column_avx2(__m256i tex_x, __m128i tile_shift, __m128i tile_area_shift, __m256i tile_mask) {
+    return _mm256_add_epi32(_mm256_sll_epi32(_mm256_srl_epi32(tex_x, tile_shift), tile_area_shift), _mm256_and_si256(tex_x, tile_mask));
+}
+
+SPAN_TARGET("avx2")
+static SPAN_INLINE __m256i texel_row_avx2(__m256i tex_y, __m128i tile_shift, __m128i tile_row_shift, __m256i tile_mask) {
+    return _mm256_add_epi32(_mm256_sll_epi32(_mm256_srl_epi32(tex_y, tile_shift), tile_row_shift), _mm256_sll_epi32(_mm256_and_si256(tex_y, tile_mask), tile_shift));
+}
+
+SPAN_TARGET("avx2")
+static SPAN_INLINE int draw_bilinear_span_avx2(int y, int x_start, int x_end, const triangle_setup_t* setup, const int raster_pass){
+    const bool write_depth = raster_pass != RASTER_PASS_SHADE;
+    uint32_t* color_row = setup->target_buffer + y * get_window_width();
+    float* depth_row = get_z_buffer() + y * get_window_width();
+    const texture_level_t* level = setup->texture_level;
+    const int* texture_buffer = (const int*)level->texels;
+
+    float reciprocal_w_dx = setup->reciprocal_w.dx;
+    float u_over_w_dx = setup->u_over_w.dx;
+    float v_over_w_dx = setup->v_over_w.dx;
+    float row_reciprocal_w = triangle_row_reciprocal_w(setup, y);
+    float u_over_w_start = triangle_gradient_at(setup->u_over_w, setup->point_a, x_start, y);
+    float v_over_w_start = triangle_gradient_at(setup->v_over_w, setup->point_a, x_start, y);
+
+    __m256 lane = _mm256_set_ps(7, 6, 5, 4, 3, 2, 1, 0);
+    __m256 one = _mm256_set1_ps(1.0f);
+    __m256 row_reciprocal_w_lanes = _mm256_set1_ps(row_reciprocal_w);
+    __m256 reciprocal_w_dx_lanes = _mm256_set1_ps(reciprocal_w_dx);
+    __m256 pixel_x = _mm256_add_ps(_mm256_set1_ps((float)x_start), lane);
+    __m256 u_over_w = _mm256_add_ps(_mm256_set1_ps(u_over_w_start), _mm256_mul_ps(lane, _mm256_set1_ps(u_over_w_dx)));
+    __m256 v_over_w = _mm256_add_ps(_mm256_set1_ps(v_over_w_start), _mm256_mul_ps(lane, _mm256_set1_ps(v_over_w_dx)));
+    __m256 pixel_x_step = _mm256_set1_ps(8.0f);
+    __m256 u_over_w_step = _mm256_set1_ps(u_over_w_dx * 8);
+    __m256 v_over_w_step = _mm256_set1_ps(v_over_w_dx * 8);
+
+    __m256 width_f = _mm256_set1_ps((float)level->width);
+    __m256 height_f = _mm256_set1_ps((float)level->height);
+    __m256 half = _mm256_set1_ps(0.5f);
+    __m256 weight_scale = _mm256_set1_ps(256.0f);
+    __m256i one_texel = _mm256_set1_epi32(1);
+    __m256i width_mask = _mm256_set1_epi32(level->width_mask);
+    __m256i height_mask = _mm256_set1_epi32(level->height_mask);
+    __m256i min_texel = _mm256_set1_epi32(level->min_texel);
+    __m256i max_texel_x = _mm256_set1_epi32(level->max_texel_x);
+    __m256i max_texel_y = _mm256_set1_epi32(level->max_texel_y);
+    __m128i tile_shift = _mm_cvtsi32_si128(level->tile_shift);
+    __m128i tile_area_shift = _mm_cvtsi32_si128(2 * level->tile_shift);
+    __m128i tile_row_shift = _mm_cvtsi32_si128(2 * level->tile_shift + level->tile_stride_shift);
+    __m256i tile_mask = _mm256_set1_epi32((1 << level->tile_shift) - 1);
+    int fragments = 0;
+
+    int x = x_start;
+    for (; x + 8 <= x_end; x += 8) {
+        __m256 reciprocal_w = _mm256_add_ps(row_reciprocal_w_lanes, _mm256_mul_ps(pixel_x, reciprocal_w_dx_lanes));
+        __m256 depth = _mm256_sub_ps(one, reciprocal_w);
+        __m256 stored_depth = _mm256_loadu_ps(depth_row + x);
+        __m256 pass = raster_pass == RASTER_PASS_SHADE ?
+            _mm256_cmp_ps(depth, stored_depth, _CMP_LE_OQ) : _mm256_cmp_ps(depth, stored_depth, _CMP_LT_OQ);
+
+        int pass_bits = _mm256_movemask_ps(pass);
+        if (pass_bits) {
+            fragments += __builtin_popcount(pass_bits);
+            __m256 w = _mm256_div_ps(one, reciprocal_w);
+
+            // Texel centers sit at half-integer coordinates
+            __m256 tex_u = _mm256_sub_ps(_mm256_mul_ps(_mm256_mul_ps(u_over_w, w), width_f), half);
+            __m256 tex_v = _mm256_sub_ps(_mm256_mul_ps(_mm256_mul_ps(v_over_w, w), height_f), half);
+            __m256 floor_u = _mm256_floor_ps(tex_u);
+            __m256 floor_v = _mm256_floor_ps(tex_v);
+            __m256i weight_x = _mm256_cvttps_epi32(_mm256_mul_ps(_mm256_sub_ps(tex_u, floor_u), weight_scale));
+            __m256i weight_y = _mm256_cvttps_epi32(_mm256_mul_ps(_mm256_sub_ps(tex_v, floor_v), weight_scale));
+
+            __m256i column = _mm256_cvttps_epi32(floor_u);
+            __m256i row = _mm256_cvttps_epi32(floor_v);
+            __m256i x0 = address_texels_avx2(column, min_texel, max_texel_x, width_mask);
+            __m256i y0 = address_texels_avx2(row, min_texel, max_texel_y, height_mask);
+            __m256i x1 = address_texels_avx2(_mm256_add_epi32(column, one_texel), min_texel, max_texel_x, width_mask);
+            __m256i y1 = address_texels_avx2(_mm256_add_epi32(row, one_texel), min_texel, max_texel_y, height_mask);
+
+            // Only lanes that passed the depth test touch texture memory
+            __m256i pass_mask = _mm256_castps_si256(pass);
+            __m256i zero = _mm256_setzero_si256();
+            __m256i column_0 = texel_column_avx2(x0, tile_shift, tile_area_shift, tile_mask);
+            __m256i column_1 = texel_column_avx2(x1, tile_shift, tile_area_shift, tile_mask);
+            __m256i row_0 = texel_row_avx2(y0, tile_shift, tile_row_shift, tile_mask);
+            __m256i row_1 = texel_row_avx2(y1, tile_shift, tile_row_shift, tile_mask);
+            __m256i texel_00 = _mm256_mask_i32gather_epi32(zero, texture_buffer, _mm256_add_epi32(row_0, column_0), pass_mask, 4);
+            __m256i texel_10 = _mm256_mask_i32gather_epi32(zero, texture_buffer, _mm256_add_epi32(row_0, column_1), pass_mask, 4);
+            __m256i texel_01 = _mm256_mask_i32gather_epi32(zero, texture_buffer, _mm256_add_epi32(row_1, column_0), pass_mask, 4);
+            __m256i texel_11 = _mm256_mask_i32gather_epi32(zero, texture_buffer, _mm256_add_epi32(row_1, column_1), pass_mask, 4);
+
+            __m256i top = lerp_texels_avx2(texel_00, texel_10, weight_x);
+            __m256i bottom = lerp_texels_avx2(texel_01, texel_11, weight_x);
+            __m256i texel = lerp_texels_avx2(top, bottom, weight_y);
+
+            __m256i old_color = _mm256_loadu_si256((__m256i*)(color_row + x));
+            _mm256_storeu_si256((__m256i*)(color_row + x), _mm256_blendv_epi8(old_color, texel, pass_mask));
+            if (write_depth) {
+                _mm256_storeu_ps(depth_row + x, _mm256_blendv_ps(stored_depth, depth, pass));
+            }
+        }
+        pixel_x = _mm256_add_ps(pixel_x, pixel_x_step);
+        u_over_w = _mm256_add_ps(u_over_w, u_over_w_step);
+        v_over_w = _mm256_add_ps(v_over_w, v_over_w_step);
+    }
+
+    // Finish the last few pixels one at a time
+    float u_over_w_tail = _mm256_cvtss_f32(u_over_w);
+    float v_over_w_tail = _mm256_cvtss_f32(v_over_w);
+    for (; x < x_end; x++) {
+        float reciprocal_w_tail = triangle_reciprocal_w_at(row_reciprocal_w, reciprocal_w_dx, x);
+        float depth = 1.0 - reciprocal_w_tail;
+        if (depth_test(depth, depth_row[x], raster_pass)) {
+            color_row[x] = sample_texture_bilinear(level, u_over_w_tail / reciprocal_w_tail, v_over_w_tail / reciprocal_w_tail);
+            if (write_depth) depth_row[x] = depth;
+            fragments++;
+        }
+        u_over_w_tail += u_over_w_dx;
+        v_over_w_tail += v_over_w_dx;
+    }
+    return fragments;
+}
+
+DEFINE_SPAN_KERNELS(draw_bilinear_span_avx2, SPAN_TARGET("avx2"))
+
+#endif
+
+///////////////////////////////////////////////////////////////////////////////
+// Runtime dispatch
+///////////////////////////////////////////////////////////////////////////////
+
+// Pick the kernel tables for the current render method and CPU; called once
+// per frame so the rasterizer never checks modes per triangle or per pixel
+void select_span_kernels(void) {
+    if (simd_spans && simd_kernel_name) {
+        flat_span_kernels = simd_flat_span_kernels;
+        textured_span_kernels = simd_textured_span_kernels;
+        bilinear_span_kernels = simd_bilinear_span_kernels;
+    } else {
+        flat_span_kernels = draw_flat_span_scalar_passes;
+        textured_span_kernels = draw_textured_span_scalar_passes;
+        bilinear_span_kernels = draw_bilinear_span_scalar_passes;
+    }
+    // The affine approximation always samples the nearest texel
+    if (should_render_affine_textures()) {
+        textured_span_kernels = draw_textured_span_affine_passes;
+        bilinear_span_kernels = draw_textured_span_affine_passes;
+    }
+}
+
+void init_span_kernels(void) {
+    simd_kernel_name = NULL;
+#ifdef SPAN_X86_KERNELS
+    // Ask the CPU (via CPUID) for the widest instruction set available
+    if (SDL_HasAVX2()) {
+        simd_flat_span_kernels = draw_flat_span_avx2_passes;
+        simd_textured_span_kernels = draw_textured_span_avx2_passes;
+        simd_bilinear_span_kernels = draw_bilinear_span_avx2_passes;
+        simd_kernel_name = "AVX2";
+    } else if (SDL_HasSSE41()) {
+        simd_flat_span_kernels = draw_flat_span_sse41_passes;
+        simd_textured_span_kernels = draw_textured_span_sse41_passes;
+        simd_bilinear_span_kernels = draw_bilinear_span_sse41_passes;
+        simd_kernel_name = "SSE4.1";
+    }
+#endif
+    select_span_kernels();
+}
+
+void set_simd_spans(bool enabled) {
+    simd_spans = enabled;
+    select_span_kernels();
+}
+
+bool is_simd_spans(void) {
+    return simd_spans;
+}
+
+const char* get_span_kernel_name(void) {
+    return (simd_spans && simd_kernel_name) ? simd_kernel_name : "scalar";
+}
+
+void set_affine_span_length(int length) {
+    affine_span_length = length < 1 ? 1 : length;
+}
+
+int get_affine_span_length(void) {
+    return affine_span_length;
+}
+
+span_function_t get_flat_span_kernel(int pass) {
+    return flat_span_kernels[pass];
+}
+
+// Kernel for the pass that samples the texture with its filter. Compressed
+// and virtual textures only have scalar kernels, whatever the SIMD and affine
+// settings.
+span_function_t get_textured_span_kernel(int pass, const texture_t* texture) {
+    bool bilinear = get_texture_sample_filter(texture) == TEXTURE_FILTER_BILINEAR;
+    if (texture->virtual_texture) {
+        return bilinear ? draw_bilinear_span_scalar_passes[pass] : draw_virtual_span_scalar_passes[pass];
+    }
+    if (texture->format == TEXTURE_FORMAT_BC1) {
+        return bilinear ? draw_bilinear_span_scalar_passes[pass] : draw_bc1_span_scalar_passes[pass];
+    }
+    return bilinear ? bilinear_span_kernels[pass] : textured_span_kernels[pass];
+}
@@ -0,0 +1,24 @@
+#ifndef SPAN_H
+#define SPAN_H
+
+#include <stdbool.h>
+#include "triangle.h"
+
+// Draws the pixels [x_start, x_end) of row y; the span is already scissored.
+// Returns how many pixels passed the depth test.
+typedef int (*span_function_t)(int y, int x_start, int x_end, const triangle_setup_t* setup);
+
+void init_span_kernels(void);
+void select_span_kernels(void);
+void set_simd_spans(bool enabled);
+bool is_simd_spans(void);
+const char* get_span_kernel_name(void);
+
+// Pixels between exact perspective divides in RENDER_TEXTURED_AFFINE
+void set_affine_span_length(int length);
+int get_affine_span_length(void);
+
+span_function_t get_flat_span_kernel(int pass);
+span_function_t get_textured_span_kernel(int pass, const texture_t* texture);
+
+#endif
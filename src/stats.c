@@ -0,0 +1,93 @@
+#include <stdio.h>
+#include <SDL2/SDL.h>
+#include "display.h"
+#include "stats.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Per-frame counters
+///////////////////////////////////////////////////////////////////////////////
+// Counters cover one frame, from the start of update() to the end of
+// render(). They are atomic because raster worker threads update them. Callers
+// accumulate locally (e.g. per triangle) and add the total once, so the
+// atomics stay off the per-pixel path.
+///////////////////////////////////////////////////////////////////////////////
+
+static SDL_atomic_t counters[NUM_STAT_COUNTERS];
+static const char* counter_names[NUM_STAT_COUNTERS] = {
+    "clip guard band accepted",
+    "clip near/far only",
+    "clip all planes",
+    "clip rejected",
+    "meshes culled",
+    "meshes unclipped",
+    "triangles full setup",
+    "triangles micro path",
+    "triangles no coverage",
+    "hiz triangles rejected",
+    "hiz blocks skipped",
+    "hiz pixels skipped",
+    "depth tested fragments",
+    "depth rejected fragments",
+    "depth pre-pass fragments",
+    "shaded fragments",
+    "visibility fragments",
+    "affine pixels",
+    "affine texel misses",
+    "affine max texel error",
+    "virtual tiles requested",
+    "virtual tiles loaded",
+    "virtual tiles evicted",
+    "virtual tiles resident"
+};
+
+static bool stats_printing = false;
+static int frames_since_print = 0;
+
+void add_stat(int counter, int value) {
+    if (value != 0) {
+        SDL_AtomicAdd(&counters[counter], value);
+    }
+}
+
+// Raise the counter to value if it is larger; used for per-frame maxima
+void max_stat(int counter, int value) {
+    int current = SDL_AtomicGet(&counters[counter]);
+    while (value > current && !SDL_AtomicCAS(&counters[counter], current, value)) {
+        current = SDL_AtomicGet(&counters[counter]);
+    }
+}
+
+int get_stat(int counter) {
+    return SDL_AtomicGet(&counters[counter]);
+}
+
+void reset_frame_stats(void) {
+    for (int i = 0; i < NUM_STAT_COUNTERS; i++) {
+        SDL_AtomicSet(&counters[i], 0);
+    }
+}
+
+void set_stats_printing(bool enabled) {
+    stats_printing = enabled;
+    frames_since_print = 0;
+}
+
+bool is_stats_printing(void) {
+    return stats_printing;
+}
+
+// Print the counters of the current frame about once per second
+void print_frame_stats(void) {
+    if (!stats_printing || frames_since_print++ % FPS != 0) {
+        return;
+    }
+    printf("---- frame stats ----\n");
+    for (int i = 0; i < NUM_STAT_COUNTERS; i++) {
+        printf("%-28s %d\n", counter_names[i], get_stat(i));
+    }
+
+    // Fragments thrown away by the depth test or skipped by Hi-Z before shading
+    int rejected = get_stat(STAT_DEPTH_REJECTED_FRAGMENTS) + get_stat(STAT_HIZ_PIXELS_SKIPPED);
+    int considered = get_stat(STAT_DEPTH_TESTED_FRAGMENTS) + get_stat(STAT_HIZ_PIXELS_SKIPPED);
+    printf("%-28s %.1f%%\n", "depth reject rate", considered ? 100.0 * rejected / considered : 0.0);
+}
@@ -0,0 +1,43 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdbool.h>
+
+enum stat_counter {
+    STAT_CLIP_GUARD_BAND_ACCEPTED,
+    STAT_CLIP_DEPTH_ONLY,
+    STAT_CLIP_FULL,
+    STAT_CLIP_REJECTED,
+    STAT_MESHES_CULLED,
+    STAT_MESHES_UNCLIPPED,
+    STAT_TRIANGLES_FULL_SETUP,
+    STAT_TRIANGLES_MICRO,
+    STAT_TRIANGLES_EMPTY,
+    STAT_HIZ_TRIANGLES_REJECTED,
+    STAT_HIZ_BLOCKS_SKIPPED,
+    STAT_HIZ_PIXELS_SKIPPED,
+    STAT_DEPTH_TESTED_FRAGMENTS,
+    STAT_DEPTH_REJECTED_FRAGMENTS,
+    STAT_DEPTH_FRAGMENTS,
+    STAT_SHADED_FRAGMENTS,
+    STAT_VISIBILITY_FRAGMENTS,
+    STAT_AFFINE_PIXELS,
+    STAT_AFFINE_TEXEL_MISSES,
+    STAT_AFFINE_MAX_TEXEL_ERROR,
+    STAT_VIRTUAL_TILES_REQUESTED,
+    STAT_VIRTUAL_TILES_LOADED,
+    STAT_VIRTUAL_TILES_EVICTED,
+    STAT_VIRTUAL_TILES_RESIDENT,
+    NUM_STAT_COUNTERS
+};
+
+void add_stat(int counter, int value);
+void max_stat(int counter, int value);
+int get_stat(int counter);
+void reset_frame_stats(void);
+
+void set_stats_printing(bool enabled);
+bool is_stats_printing(void);
+void print_frame_stats(void);
+
+#endif
@@ -1,6 +1,507 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <SDL2/SDL.h>
 #include "texture.h"
+#include "bc1.h"
+#include "virtual_texture.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define TEXTURE_X86_CONVERSION
+#include <immintrin.h>
+#endif
+
+///////////////////////////////////////////////////////////////////////////////
+// Mipmapped textures
+///////////////////////////////////////////////////////////////////////////////
+// A far away triangle covering a few pixels would otherwise sample the full
+// resolution image: every fetch lands on a new cache line of a multi-megabyte
+// buffer and neighbouring pixels skip texels, which shimmers. At load time
+// each texture gets a chain of levels, each half the size of the previous
+// one (2x2 box filter). The rasterizer picks one level per triangle so that
+// a texel of that level covers about one pixel on screen.
+//
+// Levels are stored in 4x4 texel tiles by default. In a row-major image a
+// span whose texture coordinates run along v touches a new cache line with
+// every texel; in the tiled layout the four texels above each other share a
+// line, so the cost of a fetch depends much less on how the texture is
+// oriented on screen. Samplers address texels through texel_offset() and
+// never see the difference.
+//
+// Whatever the PNG stores (gray, gray + alpha, RGB or RGBA, 1 to 16 bits per
+// sample), texels are converted once at load to 32 bits in the byte order of
+// the color buffer (SDL_PIXELFORMAT_RGBA32: R, G, B, A in memory), so the
+// samplers copy them straight to the screen. Sizes are rounded up to powers
+// of two, so wrapping a texel coordinate costs one AND with width - 1 instead
+// of an integer division. Rounding up stretches the image bilinearly and
+// never drops detail; only images over 32768 texels on a side are shrunk.
+// A texture set to clamp limits coordinates to its edges before that AND,
+// with a min and a max that a wrapping texture also runs, on bounds that
+// never bite, so no sampler branches on the mode.
+//
+// A texture can also be kept BC1 compressed, an eighth of the RGBA32 size.
+// The chain is built in RGBA32 as usual and every level is then encoded
+// block by block; samplers decode the texels they fetch.
+///////////////////////////////////////////////////////////////////////////////
+
+#define TEXTURE_ALIGNMENT 64
+
+static bool mipmapping = true;
+static int texture_filter = TEXTURE_FILTER_NEAREST;
+static int texture_layout = TEXTURE_LAYOUT_TILED;
+static int texture_format = TEXTURE_FORMAT_RGBA32;
+
+static const char* layout_names[NUM_TEXTURE_LAYOUTS] = {
+    "linear",
+    "tiled"
+};
+
+static const char* format_names[NUM_TEXTURE_FORMATS] = {
+    "rgba32",
+    "bc1"
+};
 
 tex2_t tex2_clone(tex2_t* t){
     tex2_t result = { t-> u, t->v};
     return result;
-}
\ No newline at end of file
+}
+
+void set_mipmapping(bool enabled) {
+    mipmapping = enabled;
+}
+
+bool is_mipmapping(void) {
+    return mipmapping;
+}
+
+void set_texture_filter(int filter) {
+    texture_filter = filter;
+}
+
+int get_texture_filter(void) {
+    return texture_filter;
+}
+
+// Filter the samplers use for this texture: its own, or else the global one
+int get_texture_sample_filter(const texture_t* texture) {
+    return texture->filter == TEXTURE_FILTER_GLOBAL ? texture_filter : texture->filter;
+}
+
+static void set_level_addressing(texture_level_t* level, int addressing) {
+    bool clamp = addressing == TEXTURE_ADDRESSING_CLAMP;
+    level->min_texel = clamp ? 0 : INT_MIN;
+    level->max_texel_x = clamp ? level->width - 1 : INT_MAX;
+    level->max_texel_y = clamp ? level->height - 1 : INT_MAX;
+}
+
+// Clamp texel coordinates to the edges of every level, or wrap them
+void set_texture_addressing(texture_t* texture, int addressing) {
+    texture->addressing = addressing;
+    for (int i = 0; i < texture->num_levels; i++) {
+        set_level_addressing(&texture->levels[i], addressing);
+    }
+}
+
+// Layout of the textures loaded from now on
+void set_texture_layout(int layout) {
+    texture_layout = layout;
+}
+
+int get_texture_layout(void) {
+    return texture_layout;
+}
+
+const char* get_texture_layout_name(int layout) {
+    return layout_names[layout];
+}
+
+// Format of the textures loaded from now on
+void set_texture_format(int format) {
+    texture_format = format;
+}
+
+int get_texture_format(void) {
+    return texture_format;
+}
+
+const char* get_texture_format_name(int format) {
+    return format_names[format];
+}
+
+// Average four texels channel by channel, two channels per 32-bit add
+static uint32_t average_texels(uint32_t a, uint32_t b, uint32_t c, uint32_t d) {
+    uint32_t rb = ((a & 0x00FF00FF) + (b & 0x00FF00FF) + (c & 0x00FF00FF) + (d & 0x00FF00FF) + 0x00020002) >> 2;
+    uint32_t ag = (((a >> 8) & 0x00FF00FF) + ((b >> 8) & 0x00FF00FF) + ((c >> 8) & 0x00FF00FF) + ((d >> 8) & 0x00FF00FF) + 0x00020002) >> 2;
+    return (rb & 0x00FF00FF) | ((ag & 0x00FF00FF) << 8);
+}
+
+// Box filter src into the half-size dst; odd edges reuse their last texel
+static void downsample_level(const texture_level_t* src, texture_level_t* dst) {
+    for (int y = 0; y < dst->height; y++) {
+        int y0 = 2 * y;
+        int y1 = y0 + 1 < src->height ? y0 + 1 : src->height - 1;
+        for (int x = 0; x < dst->width; x++) {
+            int x0 = 2 * x;
+            int x1 = x0 + 1 < src->width ? x0 + 1 : src->width - 1;
+            dst->texels[texel_offset(dst, x, y)] = average_texels(
+                src->texels[texel_offset(src, x0, y0)], src->texels[texel_offset(src, x1, y0)],
+                src->texels[texel_offset(src, x0, y1)], src->texels[texel_offset(src, x1, y1)]
+            );
+        }
+    }
+}
+
+// log2 of a power of two, rounded up for other values
+static int log2_int(int value) {
+    int shift = 0;
+    while ((1 << shift) < value) shift++;
+    return shift;
+}
+
+// Smallest power of two not below size, within the largest level size
+static int round_up_to_power_of_two(int size) {
+    int shift = log2_int(size);
+    if (shift > MAX_TEXTURE_LEVELS - 1) shift = MAX_TEXTURE_LEVELS - 1;
+    return 1 << shift;
+}
+
+// 32-bit words a level takes in memory, padding included
+static size_t level_words(const texture_level_t* level) {
+    int height_shift = log2_int(level->height);
+    int tile_rows_shift = height_shift > level->tile_shift ? height_shift - level->tile_shift : 0;
+    size_t tiles = (size_t)1 << (level->tile_stride_shift + tile_rows_shift);
+    if (level->format == TEXTURE_FORMAT_BC1) {
+        return tiles * BC1_BLOCK_WORDS;
+    }
+    return tiles << (2 * level->tile_shift);
+}
+
+// Lay out every level of the chain in one cache line aligned block. Tiled
+// levels are padded to whole tiles; the padding is never sampled. BC1 levels
+// are always tiled, one block per tile.
+static void allocate_texture_levels(texture_t* texture, int layout, int format) {
+    if (format == TEXTURE_FORMAT_BC1) {
+        layout = TEXTURE_LAYOUT_TILED;
+    }
+    int tile_shift = layout == TEXTURE_LAYOUT_TILED ? TEXTURE_TILE_SHIFT : 0;
+
+    size_t total_words = 0;
+    for (int i = 0; i < texture->num_levels; i++) {
+        texture_level_t* level = &texture->levels[i];
+        int width_shift = log2_int(level->width);
+        level->virtual_level = NULL;
+        level->format = format;
+        level->width_mask = level->width - 1;
+        level->height_mask = level->height - 1;
+        set_level_addressing(level, texture->addressing);
+        level->tile_shift = tile_shift;
+        level->tile_stride_shift = width_shift > tile_shift ? width_shift - tile_shift : 0;
+        total_words += level_words(level);
+    }
+
+    texture->layout = layout;
+    texture->format = format;
+    texture->allocation = malloc(sizeof(uint32_t) * total_words + TEXTURE_ALIGNMENT);
+    uint32_t* texels = (uint32_t*)(((uintptr_t)texture->allocation + TEXTURE_ALIGNMENT - 1) & ~(uintptr_t)(TEXTURE_ALIGNMENT - 1));
+    for (int i = 0; i < texture->num_levels; i++) {
+        texture_level_t* level = &texture->levels[i];
+        level->texels = texels;
+        texels += level_words(level);
+    }
+}
+
+// Sample index of a stream of bitdepth-bit samples, scaled to 8 bits.
+// Sub-byte samples are packed most significant bit first, 16-bit samples
+// are big-endian.
+static uint8_t read_png_sample(const unsigned char* buffer, size_t index, int bitdepth) {
+    if (bitdepth == 8) {
+        return buffer[index];
+    }
+    if (bitdepth == 16) {
+        return buffer[2 * index];
+    }
+    size_t bit = index * bitdepth;
+    int max_value = (1 << bitdepth) - 1;
+    int value = (buffer[bit >> 3] >> (8 - bitdepth - (bit & 7))) & max_value;
+    return (uint8_t)(value * 255 / max_value);
+}
+
+#ifdef TEXTURE_X86_CONVERSION
+// RGB8 to RGBA8, 4 texels per shuffle. Returns how many texels were done;
+// the loads read 16 bytes, so the last few texels are left to the caller.
+__attribute__((target("ssse3")))
+static size_t convert_rgb8_ssse3(const unsigned char* rgb, uint32_t* texels, size_t num_texels) {
+    const __m128i shuffle = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+    const __m128i alpha = _mm_set1_epi32((int)0xFF000000);
+    size_t i = 0;
+    for (; i + 6 <= num_texels; i += 4) {
+        __m128i pixels = _mm_loadu_si128((const __m128i*)(rgb + 3 * i));
+        _mm_storeu_si128((__m128i*)(texels + i), _mm_or_si128(_mm_shuffle_epi8(pixels, shuffle), alpha));
+    }
+    return i;
+}
+#endif
+
+// Convert the decoded PNG of any upng_format to row-major RGBA8 texels
+static void convert_png_texels(upng_t* png_image, uint32_t* texels) {
+    const unsigned char* buffer = upng_get_buffer(png_image);
+    size_t num_texels = (size_t)upng_get_width(png_image) * upng_get_height(png_image);
+    int components = upng_get_components(png_image);
+    int bitdepth = upng_get_bitdepth(png_image);
+
+    if (components == 4 && bitdepth == 8) {
+        memcpy(texels, buffer, sizeof(uint32_t) * num_texels);
+        return;
+    }
+
+    size_t i = 0;
+#ifdef TEXTURE_X86_CONVERSION
+    if (components == 3 && bitdepth == 8 && SDL_HasSSSE3()) {
+        i = convert_rgb8_ssse3(buffer, texels, num_texels);
+    }
+#endif
+    unsigned char* bytes = (unsigned char*)texels;
+    for (; i < num_texels; i++) {
+        size_t sample = i * components;
+        unsigned char* texel = bytes + 4 * i;
+        if (components <= 2) {
+            // Gray, or gray and alpha
+            texel[0] = texel[1] = texel[2] = read_png_sample(buffer, sample, bitdepth);
+            texel[3] = components == 2 ? read_png_sample(buffer, sample + 1, bitdepth) : 0xFF;
+        } else {
+            texel[0] = read_png_sample(buffer, sample, bitdepth);
+            texel[1] = read_png_sample(buffer, sample + 1, bitdepth);
+            texel[2] = read_png_sample(buffer, sample + 2, bitdepth);
+            texel[3] = components == 4 ? read_png_sample(buffer, sample + 3, bitdepth) : 0xFF;
+        }
+    }
+}
+
+// Blend two texels with an 8-bit weight for b, two channels per multiply
+static uint32_t lerp_texels(uint32_t a, uint32_t b, uint32_t weight) {
+    uint32_t rb = (((a & 0x00FF00FF) * (256 - weight) + (b & 0x00FF00FF) * weight) >> 8) & 0x00FF00FF;
+    uint32_t ag = (((a >> 8) & 0x00FF00FF) * (256 - weight) + ((b >> 8) & 0x00FF00FF) * weight) & 0xFF00FF00;
+    return rb | ag;
+}
+
+// Bilinear resize of row-major texels into the base level, clamping at the
+// borders; only used to stretch an image that is not a power of two
+static void resample_texels(const uint32_t* texels, int width, int height, texture_level_t* level) {
+    float scale_x = (float)width / level->width;
+    float scale_y = (float)height / level->height;
+    for (int y = 0; y < level->height; y++) {
+        float source_y = (y + 0.5f) * scale_y - 0.5f;
+        if (source_y < 0) source_y = 0;
+        int y0 = (int)source_y;
+        int y1 = y0 + 1 < height ? y0 + 1 : height - 1;
+        uint32_t weight_y = (uint32_t)((source_y - y0) * 256);
+        for (int x = 0; x < level->width; x++) {
+            float source_x = (x + 0.5f) * scale_x - 0.5f;
+            if (source_x < 0) source_x = 0;
+            int x0 = (int)source_x;
+            int x1 = x0 + 1 < width ? x0 + 1 : width - 1;
+            uint32_t weight_x = (uint32_t)((source_x - x0) * 256);
+            uint32_t top = lerp_texels(texels[y0 * width + x0], texels[y0 * width + x1], weight_x);
+            uint32_t bottom = lerp_texels(texels[y1 * width + x0], texels[y1 * width + x1], weight_x);
+            level->texels[texel_offset(level, x, y)] = lerp_texels(top, bottom, weight_y);
+        }
+    }
+}
+
+texture_t* texture_from_png(upng_t* png_image) {
+    int png_width = upng_get_width(png_image);
+    int png_height = upng_get_height(png_image);
+    if (upng_get_format(png_image) == UPNG_BADFORMAT || png_width == 0 || png_height == 0) {
+        fprintf(stderr, "Unsupported texture format.\n");
+        return NULL;
+    }
+
+    uint32_t* png_texels = (uint32_t*)malloc(sizeof(uint32_t) * png_width * png_height);
+    convert_png_texels(png_image, png_texels);
+
+    // Size the whole chain first so all levels share one allocation
+    texture_t* texture = (texture_t*)malloc(sizeof(texture_t));
+    texture->filter = TEXTURE_FILTER_GLOBAL;
+    texture->addressing = TEXTURE_ADDRESSING_WRAP;
+    texture->virtual_texture = NULL;
+    int width = round_up_to_power_of_two(png_width);
+    int height = round_up_to_power_of_two(png_height);
+    texture->num_levels = 0;
+    while (texture->num_levels < MAX_TEXTURE_LEVELS) {
+        texture_level_t* level = &texture->levels[texture->num_levels++];
+        level->width = width;
+        level->height = height;
+        if (width == 1 && height == 1) {
+            break;
+        }
+        width = width > 1 ? width / 2 : 1;
+        height = height > 1 ? height / 2 : 1;
+    }
+    allocate_texture_levels(texture, texture_layout, TEXTURE_FORMAT_RGBA32);
+
+    texture_level_t* base = &texture->levels[0];
+    if (base->width == png_width && base->height == png_height) {
+        for (int y = 0; y < base->height; y++) {
+            for (int x = 0; x < base->width; x++) {
+                base->texels[texel_offset(base, x, y)] = png_texels[y * base->width + x];
+            }
+        }
+    } else {
+        resample_texels(png_texels, png_width, png_height, base);
+    }
+    free(png_texels);
+
+    for (int i = 1; i < texture->num_levels; i++) {
+        downsample_level(&texture->levels[i - 1], &texture->levels[i]);
+    }
+    convert_texture_format(texture, texture_format);
+    return texture;
+}
+
+// Repack all levels of a loaded texture into another layout. BC1 blocks
+// already are 4x4 tiles, so compressed textures keep theirs; virtual
+// textures keep the layout of their tile file.
+void convert_texture_layout(texture_t* texture, int layout) {
+    if (texture == NULL || texture->layout == layout || texture->format == TEXTURE_FORMAT_BC1 || texture->virtual_texture) {
+        return;
+    }
+    texture_t source = *texture;
+    allocate_texture_levels(texture, layout, TEXTURE_FORMAT_RGBA32);
+    for (int i = 0; i < texture->num_levels; i++) {
+        const texture_level_t* from = &source.levels[i];
+        texture_level_t* to = &texture->levels[i];
+        for (int y = 0; y < to->height; y++) {
+            for (int x = 0; x < to->width; x++) {
+                to->texels[texel_offset(to, x, y)] = from->texels[texel_offset(from, x, y)];
+            }
+        }
+    }
+    free(source.allocation);
+}
+
+// Compress all levels of a loaded texture to BC1, or decode them back to
+// RGBA32 in the current layout. Decoding does not bring back the texels the
+// compression lost. Virtual textures stay as they are.
+void convert_texture_format(texture_t* texture, int format) {
+    if (texture == NULL || texture->format == format || texture->virtual_texture) {
+        return;
+    }
+    texture_t source = *texture;
+    allocate_texture_levels(texture, texture_layout, format);
+    for (int i = 0; i < texture->num_levels; i++) {
+        const texture_level_t* from = &source.levels[i];
+        texture_level_t* to = &texture->levels[i];
+        if (format == TEXTURE_FORMAT_BC1) {
+            // Levels under 4 texels wide or high repeat to fill their block
+            for (int block_y = 0; block_y < (to->height + 3) / 4; block_y++) {
+                for (int block_x = 0; block_x < (to->width + 3) / 4; block_x++) {
+                    uint32_t block_texels[16];
+                    for (int t = 0; t < 16; t++) {
+                        int x = (block_x * 4 + (t & 3)) & from->width_mask;
+                        int y = (block_y * 4 + (t >> 2)) & from->height_mask;
+                        block_texels[t] = fetch_texel(from, x, y);
+                    }
+                    uint32_t* block = to->texels + BC1_BLOCK_WORDS * ((block_y << to->tile_stride_shift) + block_x);
+                    encode_bc1_block(block_texels, block);
+                }
+            }
+        } else {
+            for (int y = 0; y < to->height; y++) {
+                for (int x = 0; x < to->width; x++) {
+                    to->texels[texel_offset(to, x, y)] = fetch_texel(from, x, y);
+                }
+            }
+        }
+    }
+    free(source.allocation);
+}
+
+// Independent copy of a texture, levels and settings included. Virtual
+// textures have no texels of their own to copy.
+texture_t* copy_texture(const texture_t* texture) {
+    if (texture->virtual_texture) {
+        return NULL;
+    }
+    texture_t* copy = (texture_t*)malloc(sizeof(texture_t));
+    *copy = *texture;
+    allocate_texture_levels(copy, texture->layout, texture->format);
+    memcpy(copy->levels[0].texels, texture->levels[0].texels, get_texture_memory_size(texture));
+    return copy;
+}
+
+// Bytes taken by all levels, padding included
+size_t get_texture_memory_size(const texture_t* texture) {
+    size_t words = 0;
+    for (int i = 0; i < texture->num_levels; i++) {
+        words += level_words(&texture->levels[i]);
+    }
+    return sizeof(uint32_t) * words;
+}
+
+uint32_t decode_bc1_texel(const texture_level_t* level, int x, int y) {
+    const uint32_t* block = level->texels + BC1_BLOCK_WORDS * (((y >> level->tile_shift) << level->tile_stride_shift) + (x >> level->tile_shift));
+    return decode_bc1_texel_in_block(block, x, y);
+}
+
+void free_texture(texture_t* texture) {
+    if (texture == NULL) {
+        return;
+    }
+    free_virtual_texture(texture->virtual_texture);
+    free(texture->allocation);
+    free(texture);
+}
+
+// Level for a triangle covering uv_area of the texture (in normalized UV
+// units) and screen_area pixels. Their ratio in texels is the determinant of
+// the screen-space UV derivatives: exact for an affine mapping, the average
+// over the triangle under perspective. Each level quarters the texel count.
+int select_texture_level(const texture_t* texture, float uv_area, float screen_area) {
+    if (!mipmapping || !(screen_area > 0)) {
+        return 0;
+    }
+    float texels_per_pixel = uv_area * texture->levels[0].width * texture->levels[0].height / screen_area;
+    if (!(texels_per_pixel > 1)) {
+        return 0;
+    }
+    int level = (int)(0.5f * log2f(texels_per_pixel) + 0.5f);
+    return level < texture->num_levels ? level : texture->num_levels - 1;
+}
+
+// Bilinear sample of a level at normalized (u, v), wrapped or clamped at the
+// borders
+uint32_t sample_texture_bilinear(const texture_level_t* level, float u, float v) {
+    // Texel centers sit at half-integer coordinates
+    float x = u * level->width - 0.5f;
+    float y = v * level->height - 0.5f;
+    float x_floor = floorf(x);
+    float y_floor = floorf(y);
+    uint32_t weight_x = (uint32_t)((x - x_floor) * 256);
+    uint32_t weight_y = (uint32_t)((y - y_floor) * 256);
+
+    int x0 = address_texel((int)x_floor, level->min_texel, level->max_texel_x, level->width_mask);
+    int y0 = address_texel((int)y_floor, level->min_texel, level->max_texel_y, level->height_mask);
+    int x1 = address_texel((int)x_floor + 1, level->min_texel, level->max_texel_x, level->width_mask);
+    int y1 = address_texel((int)y_floor + 1, level->min_texel, level->max_texel_y, level->height_mask);
+
+    uint32_t texel_00, texel_10, texel_01, texel_11;
+    if (level->format == TEXTURE_FORMAT_BC1 && (x0 >> 2) == (x1 >> 2) && (y0 >> 2) == (y1 >> 2)) {
+        // Most footprints sit inside one block: decode its palette once
+        const uint32_t* block = level->texels + BC1_BLOCK_WORDS * (((y0 >> 2) << level->tile_stride_shift) + (x0 >> 2));
+        uint32_t palette[4];
+        decode_bc1_palette(block, palette);
+        texel_00 = palette[bc1_texel_index(block, x0, y0)];
+        texel_10 = palette[bc1_texel_index(block, x1, y0)];
+        texel_01 = palette[bc1_texel_index(block, x0, y1)];
+        texel_11 = palette[bc1_texel_index(block, x1, y1)];
+    } else {
+        texel_00 = fetch_texel(level, x0, y0);
+        texel_10 = fetch_texel(level, x1, y0);
+        texel_01 = fetch_texel(level, x0, y1);
+        texel_11 = fetch_texel(level, x1, y1);
+    }
+    uint32_t top = lerp_texels(texel_00, texel_10, weight_x);
+    uint32_t bottom = lerp_texels(texel_01, texel_11, weight_x);
+    return lerp_texels(top, bottom, weight_y);
+}
@@ -1,11 +1,152 @@
 #ifndef TEXTURE_H
 #define TEXTURE_H
 
+#include <stddef.h>
+#include <stdint.h>
+#include <limits.h>
+#include <stdbool.h>
+#include "upng.h"
+
+// Enough levels for a 32768x32768 texture
+#define MAX_TEXTURE_LEVELS 16
 
 typedef struct {
     float u;
     float v;
 } tex2_t;
 
+// Side of the square texel tiles of TEXTURE_LAYOUT_TILED: 4x4 texels of 32
+// bits fill exactly one 64-byte cache line
+#define TEXTURE_TILE_SHIFT 2
+
+// Order of the texels in memory
+enum texture_layout {
+    TEXTURE_LAYOUT_LINEAR,
+    TEXTURE_LAYOUT_TILED,
+    NUM_TEXTURE_LAYOUTS
+};
+
+// How the texels are stored
+enum texture_format {
+    TEXTURE_FORMAT_RGBA32,
+    TEXTURE_FORMAT_BC1,
+    NUM_TEXTURE_FORMATS
+};
+
+// One level of a mip chain: 32-bit texels in the color buffer's byte order,
+// in square tiles of (1 << tile_shift) texels a side, tiles and texels within
+// a tile both row-major. A row-major image is the 1x1 tile case. Sizes are
+// powers of two, so texel coordinates wrap with a single AND. Samplers floor
+// u * width before converting: truncation would round negative coordinates
+// toward zero and pick the wrong texel. A clamping texture first limits them
+// to [min_texel, max_texel_x] and [min_texel, max_texel_y]; a wrapping one
+// keeps the whole int range there, so both kinds share one code path.
+//
+// A BC1 level is always tiled 4x4 and stores one compressed block in place
+// of each tile (see bc1.h). A virtual level has no texels of its own, they
+// are streamed in tiles through its virtual_level (see virtual_texture.h).
+// Read both kinds through fetch_texel().
+struct virtual_level;
+struct virtual_texture;
+
+typedef struct {
+    uint32_t* texels;
+    struct virtual_level* virtual_level;
+    int format;
+    int width;
+    int height;
+    int width_mask;
+    int height_mask;
+    int min_texel;          // 0 when clamping, INT_MIN when wrapping
+    int max_texel_x;        // width - 1 when clamping, INT_MAX when wrapping
+    int max_texel_y;
+    int tile_shift;
+    int tile_stride_shift;  // log2 of the tiles per row of tiles
+} texture_level_t;
+
+// Render-side texture: the decoded image followed by its box-filtered mip
+// chain down to 1x1, all in one allocation owned by the texture, or a
+// virtual texture streamed from disk. The filter overrides the global one for
+// this asset, unless it is TEXTURE_FILTER_GLOBAL. Textures wrap unless set to
+// clamp with set_texture_addressing().
+typedef struct {
+    int layout;
+    int format;
+    int filter;
+    int addressing;
+    int num_levels;
+    texture_level_t levels[MAX_TEXTURE_LEVELS];
+    void* allocation;
+    struct virtual_texture* virtual_texture;
+} texture_t;
+
+// Offset of texel (x, y) in its level, whatever the layout
+static inline int texel_offset(const texture_level_t* level, int x, int y) {
+    int shift = level->tile_shift;
+    int mask = (1 << shift) - 1;
+    int tile = ((y >> shift) << level->tile_stride_shift) + (x >> shift);
+    return (tile << (2 * shift)) + ((y & mask) << shift) + (x & mask);
+}
+
+// Texel coordinate of a floored u * width or v * height: clamped to the edges
+// of a clamping level, then wrapped with the mask
+static inline int address_texel(int coordinate, int min_texel, int max_texel, int mask) {
+    coordinate = coordinate < min_texel ? min_texel : coordinate;
+    coordinate = coordinate > max_texel ? max_texel : coordinate;
+    return coordinate & mask;
+}
+
+uint32_t decode_bc1_texel(const texture_level_t* level, int x, int y);
+uint32_t fetch_virtual_texel(const texture_level_t* level, int x, int y);
+
+// Texel (x, y) of the level, whatever the layout and format
+static inline uint32_t fetch_texel(const texture_level_t* level, int x, int y) {
+    if (level->virtual_level) {
+        return fetch_virtual_texel(level, x, y);
+    }
+    if (level->format == TEXTURE_FORMAT_BC1) {
+        return decode_bc1_texel(level, x, y);
+    }
+    return level->texels[texel_offset(level, x, y)];
+}
+
+enum texture_filter {
+    TEXTURE_FILTER_NEAREST,
+    TEXTURE_FILTER_BILINEAR,
+    TEXTURE_FILTER_GLOBAL
+};
+
+// What sampling does past the texture's edges
+enum texture_addressing {
+    TEXTURE_ADDRESSING_WRAP,
+    TEXTURE_ADDRESSING_CLAMP
+};
+
 tex2_t tex2_clone(tex2_t* t);
-#endif
\ No newline at end of file
+
+texture_t* texture_from_png(upng_t* png_image);
+void free_texture(texture_t* texture);
+
+void set_texture_layout(int layout);
+int get_texture_layout(void);
+const char* get_texture_layout_name(int layout);
+void convert_texture_layout(texture_t* texture, int layout);
+
+void set_texture_format(int format);
+int get_texture_format(void);
+const char* get_texture_format_name(int format);
+void convert_texture_format(texture_t* texture, int format);
+texture_t* copy_texture(const texture_t* texture);
+size_t get_texture_memory_size(const texture_t* texture);
+
+void set_mipmapping(bool enabled);
+bool is_mipmapping(void);
+void set_texture_filter(int filter);
+int get_texture_filter(void);
+int get_texture_sample_filter(const texture_t* texture);
+void set_texture_addressing(texture_t* texture, int addressing);
+
+int select_texture_level(const texture_t* texture, float uv_area, float screen_area);
+uint32_t sample_texture_bilinear(const texture_level_t* level, float u, float v);
+
+#endif
@@ -0,0 +1,112 @@
+#include <stdbool.h>
+#include <SDL2/SDL.h>
+#include "threadpool.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Fixed pool of worker threads
+///////////////////////////////////////////////////////////////////////////////
+// run_parallel_jobs() wakes every worker, then all threads (including the
+// calling one, which acts as thread 0) pull job indices from a shared atomic
+// counter until none are left. The call returns once every job has finished,
+// so the caller can treat it like an ordinary blocking loop.
+///////////////////////////////////////////////////////////////////////////////
+
+typedef struct {
+    SDL_Thread* thread;
+    int index;
+} worker_t;
+
+static worker_t workers[MAX_NUM_THREADS];
+static int num_threads = 1;
+static bool is_shutting_down = false;
+
+static SDL_sem* work_ready = NULL;
+static SDL_sem* work_done = NULL;
+
+static job_function_t job_function = NULL;
+static void* job_data = NULL;
+static int num_jobs_queued = 0;
+static SDL_atomic_t next_job;
+
+static void run_jobs(int thread_index) {
+    int job_index;
+    while ((job_index = SDL_AtomicAdd(&next_job, 1)) < num_jobs_queued) {
+        job_function(job_index, thread_index, job_data);
+    }
+}
+
+static int worker_loop(void* data) {
+    worker_t* worker = (worker_t*)data;
+    while (true) {
+        SDL_SemWait(work_ready);
+        if (is_shutting_down) {
+            break;
+        }
+        run_jobs(worker->index);
+        SDL_SemPost(work_done);
+    }
+    return 0;
+}
+
+void init_thread_pool(int requested_threads) {
+    if (requested_threads < 1) requested_threads = 1;
+    if (requested_threads > MAX_NUM_THREADS) requested_threads = MAX_NUM_THREADS;
+
+    work_ready = SDL_CreateSemaphore(0);
+    work_done = SDL_CreateSemaphore(0);
+    is_shutting_down = false;
+
+    // Thread 0 is always the caller, so only spawn the extra workers
+    num_threads = 1;
+    for (int i = 1; i < requested_threads; i++) {
+        workers[i].index = i;
+        workers[i].thread = SDL_CreateThread(worker_loop, "raster_worker", &workers[i]);
+        if (!workers[i].thread) {
+            fprintf(stderr, "Error creating worker thread %d.\n", i);
+            break;
+        }
+        num_threads++;
+    }
+}
+
+int get_num_threads(void) {
+    return num_threads;
+}
+
+void run_parallel_jobs(int num_jobs, job_function_t function, void* data) {
+    if (num_jobs <= 0) {
+        return;
+    }
+
+    job_function = function;
+    job_data = data;
+    num_jobs_queued = num_jobs;
+    SDL_AtomicSet(&next_job, 0);
+
+    // Only wake as many workers as there are jobs for them to pick up
+    int num_helpers = (num_jobs < num_threads ? num_jobs : num_threads) - 1;
+    for (int i = 0; i < num_helpers; i++) {
+        SDL_SemPost(work_ready);
+    }
+
+    run_jobs(0);
+
+    for (int i = 0; i < num_helpers; i++) {
+        SDL_SemWait(work_done);
+    }
+}
+
+void free_thread_pool(void) {
+    is_shutting_down = true;
+    for (int i = 1; i < num_threads; i++) {
+        SDL_SemPost(work_ready);
+    }
+    for (int i = 1; i < num_threads; i++) {
+        SDL_WaitThread(workers[i].thread, NULL);
+    }
+    SDL_DestroySemaphore(work_ready);
+    SDL_DestroySemaphore(work_done);
+    work_ready = NULL;
+    work_done = NULL;
+    num_threads = 1;
+}
@@ -0,0 +1,14 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#define MAX_NUM_THREADS 64
+
+// A job callback receives the job index and the index of the thread running it
+typedef void (*job_function_t)(int job_index, int thread_index, void* data);
+
+void init_thread_pool(int num_threads);
+int get_num_threads(void);
+void run_parallel_jobs(int num_jobs, job_function_t function, void* data);
+void free_thread_pool(void);
+
+#endif
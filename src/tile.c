@@ -0,0 +1,283 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "threadpool.h"
+#include "tile.h"
+#include "visibility.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Sort-middle tiled rasterization
+///////////////////////////////////////////////////////////////////////////////
+// The screen is split in TILE_SIZE x TILE_SIZE tiles. Every projected
+// triangle is binned into each tile its screen bounding box overlaps, keeping
+// submission order inside each bin. Tiles are then rasterized in parallel by
+// the thread pool, each one scissored to its own rectangle, so no two threads
+// ever touch the same color or z-buffer pixel and the result is identical to
+// drawing the triangles in order on a single thread.
+//
+// With the depth pre-pass on, each tile first rasterizes the depth of all its
+// triangles and then shades only the pixels that ended up visible, so hidden
+// surfaces never pay for texture fetches. Both passes run back to back in the
+// same tile job while the tile's z-buffer rows are still in cache.
+//
+// In visibility buffer mode each tile job clears its part of the buffer,
+// rasterizes triangle ids and then resolves (shades) the tile, all on the
+// thread that owns the tile.
+///////////////////////////////////////////////////////////////////////////////
+//
+//   +----+----+----+      bin_offsets[tile] --> first entry of the tile
+//   | T0 | T1 | T2 |      bin_triangles[]   --> triangle indices, tile by
+//   +----+----+----+                            tile, in submission order
+//   | T3 | T4 | T5 |
+//   +----+----+----+
+//
+///////////////////////////////////////////////////////////////////////////////
+
+static int num_tiles_x = 0;
+static int num_tiles_y = 0;
+static int num_tiles = 0;
+
+static int* bin_counts = NULL;
+static int* bin_offsets = NULL;
+static int* bin_triangles = NULL;
+static int bin_capacity = 0;
+
+static bool tiled_rendering = true;
+static bool depth_prepass = false;
+
+// Surface rasterizer of the current render method, picked once per frame
+static surface_function_t draw_surface = NULL;
+
+typedef struct {
+    triangle_t* triangles;
+} tile_job_t;
+
+void init_tiles(int width, int height) {
+    num_tiles_x = (width + TILE_SIZE - 1) / TILE_SIZE;
+    num_tiles_y = (height + TILE_SIZE - 1) / TILE_SIZE;
+    num_tiles = num_tiles_x * num_tiles_y;
+
+    bin_counts = (int*)malloc(sizeof(int) * num_tiles);
+    bin_offsets = (int*)malloc(sizeof(int) * (num_tiles + 1));
+}
+
+void set_tiled_rendering(bool enabled) {
+    tiled_rendering = enabled;
+}
+
+bool is_tiled_rendering(void) {
+    return tiled_rendering;
+}
+
+void set_depth_prepass(bool enabled) {
+    depth_prepass = enabled;
+}
+
+bool is_depth_prepass(void) {
+    return depth_prepass;
+}
+
+// Rasterize only the depth of one triangle inside clip
+void draw_triangle_depth(triangle_t* triangle, rect_t clip) {
+    draw_filled_triangle(
+        triangle->points[0].x, triangle->points[0].y, triangle->points[0].z, triangle->points[0].w,
+        triangle->points[1].x, triangle->points[1].y, triangle->points[1].z, triangle->points[1].w,
+        triangle->points[2].x, triangle->points[2].y, triangle->points[2].z, triangle->points[2].w,
+        0, clip, RASTER_PASS_DEPTH
+    );
+}
+
+// Rasterize the id of one triangle into the visibility buffer inside clip
+void draw_triangle_visibility(triangle_t* triangle, int index, rect_t clip) {
+    draw_filled_triangle(
+        triangle->points[0].x, triangle->points[0].y, triangle->points[0].z, triangle->points[0].w,
+        triangle->points[1].x, triangle->points[1].y, triangle->points[1].z, triangle->points[1].w,
+        triangle->points[2].x, triangle->points[2].y, triangle->points[2].z, triangle->points[2].w,
+        index + 1, clip, RASTER_PASS_VISIBILITY
+    );
+}
+
+// Rasterize the flat-shaded surface of one triangle inside clip
+static void draw_filled_surface(triangle_t* triangle, rect_t clip, int pass) {
+    draw_filled_triangle(
+        triangle->points[0].x, triangle->points[0].y, triangle->points[0].z, triangle->points[0].w,
+        triangle->points[1].x, triangle->points[1].y, triangle->points[1].z, triangle->points[1].w,
+        triangle->points[2].x, triangle->points[2].y, triangle->points[2].z, triangle->points[2].w,
+        triangle->color, clip, pass
+    );
+}
+
+// Rasterize the textured surface of one triangle inside clip
+static void draw_textured_surface(triangle_t* triangle, rect_t clip, int pass) {
+    draw_textured_triangle(
+        triangle->points[0].x, triangle->points[0].y, triangle->points[0].z, triangle->points[0].w, triangle->texcoords[0].u, triangle->texcoords[0].v,
+        triangle->points[1].x, triangle->points[1].y, triangle->points[1].z, triangle->points[1].w, triangle->texcoords[1].u, triangle->texcoords[1].v,
+        triangle->points[2].x, triangle->points[2].y, triangle->points[2].z, triangle->points[2].w, triangle->texcoords[2].u, triangle->texcoords[2].v,
+        triangle->texture, clip, pass
+    );
+}
+
+// Find the inclusive range of tiles covered by the triangle screen bounding box
+static bool triangle_tile_range(triangle_t* triangle, int* tx0, int* ty0, int* tx1, int* ty1) {
+    float min_x = triangle->points[0].x;
+    float max_x = triangle->points[0].x;
+    float min_y = triangle->points[0].y;
+    float max_y = triangle->points[0].y;
+    for (int i = 1; i < 3; i++) {
+        if (triangle->points[i].x < min_x) min_x = triangle->points[i].x;
+        if (triangle->points[i].x > max_x) max_x = triangle->points[i].x;
+        if (triangle->points[i].y < min_y) min_y = triangle->points[i].y;
+        if (triangle->points[i].y > max_y) max_y = triangle->points[i].y;
+    }
+
+    // The rasterizer covers pixels whose centers fall inside the triangle, so
+    // the truncated box is conservative; reject triangles completely off screen
+    rect_t viewport = get_viewport_rect();
+    if (!(max_x >= viewport.x_min && min_x < viewport.x_max && max_y >= viewport.y_min && min_y < viewport.y_max)) {
+        return false;
+    }
+    int x0 = min_x < viewport.x_min ? viewport.x_min : (int)min_x;
+    int y0 = min_y < viewport.y_min ? viewport.y_min : (int)min_y;
+    int x1 = max_x >= viewport.x_max ? viewport.x_max - 1 : (int)max_x;
+    int y1 = max_y >= viewport.y_max ? viewport.y_max - 1 : (int)max_y;
+
+    *tx0 = x0 / TILE_SIZE;
+    *ty0 = y0 / TILE_SIZE;
+    *tx1 = x1 / TILE_SIZE;
+    *ty1 = y1 / TILE_SIZE;
+    return true;
+}
+
+static void bin_triangles_to_tiles(triangle_t* triangles, int num_triangles) {
+    for (int i = 0; i < num_tiles; i++) {
+        bin_counts[i] = 0;
+    }
+
+    // First pass counts how many triangles land in each tile
+    int tx0, ty0, tx1, ty1;
+    for (int i = 0; i < num_triangles; i++) {
+        if (!triangle_tile_range(&triangles[i], &tx0, &ty0, &tx1, &ty1)) continue;
+        for (int ty = ty0; ty <= ty1; ty++) {
+            for (int tx = tx0; tx <= tx1; tx++) {
+                bin_counts[ty * num_tiles_x + tx]++;
+            }
+        }
+    }
+
+    // Prefix sum gives every tile a contiguous slice of the index buffer
+    bin_offsets[0] = 0;
+    for (int i = 0; i < num_tiles; i++) {
+        bin_offsets[i + 1] = bin_offsets[i] + bin_counts[i];
+        bin_counts[i] = 0;
+    }
+    if (bin_offsets[num_tiles] > bin_capacity) {
+        int* grown = (int*)realloc(bin_triangles, sizeof(int) * bin_offsets[num_tiles] * 2);
+        if (!grown) {
+            // Keep the old buffer and draw nothing this frame
+            fprintf(stderr, "Error growing the tile bins to %d triangles.\n", bin_offsets[num_tiles] * 2);
+            for (int i = 0; i <= num_tiles; i++) {
+                bin_offsets[i] = 0;
+            }
+            return;
+        }
+        bin_triangles = grown;
+        bin_capacity = bin_offsets[num_tiles] * 2;
+    }
+
+    // Second pass writes the triangle indices in submission order
+    for (int i = 0; i < num_triangles; i++) {
+        if (!triangle_tile_range(&triangles[i], &tx0, &ty0, &tx1, &ty1)) continue;
+        for (int ty = ty0; ty <= ty1; ty++) {
+            for (int tx = tx0; tx <= tx1; tx++) {
+                int tile = ty * num_tiles_x + tx;
+                bin_triangles[bin_offsets[tile] + bin_counts[tile]++] = i;
+            }
+        }
+    }
+}
+
+static void render_tile_job(int tile, int thread_index, void* data) {
+    (void)thread_index;
+    tile_job_t* job = (tile_job_t*)data;
+    rect_t viewport = get_viewport_rect();
+
+    int tile_x = (tile % num_tiles_x) * TILE_SIZE;
+    int tile_y = (tile / num_tiles_x) * TILE_SIZE;
+    rect_t clip = {
+        .x_min = tile_x,
+        .y_min = tile_y,
+        .x_max = tile_x + TILE_SIZE < viewport.x_max ? tile_x + TILE_SIZE : viewport.x_max,
+        .y_max = tile_y + TILE_SIZE < viewport.y_max ? tile_y + TILE_SIZE : viewport.y_max
+    };
+
+    if (is_visibility_rendering()) {
+        clear_visibility_rect(clip);
+        for (int i = bin_offsets[tile]; i < bin_offsets[tile + 1]; i++) {
+            draw_triangle_visibility(&job->triangles[bin_triangles[i]], bin_triangles[i], clip);
+        }
+        resolve_visibility_rect(job->triangles, clip);
+        return;
+    }
+
+    if (!depth_prepass) {
+        for (int i = bin_offsets[tile]; i < bin_offsets[tile + 1]; i++) {
+            draw_surface(&job->triangles[bin_triangles[i]], clip, RASTER_PASS_SINGLE);
+        }
+        return;
+    }
+
+    for (int i = bin_offsets[tile]; i < bin_offsets[tile + 1]; i++) {
+        draw_triangle_depth(&job->triangles[bin_triangles[i]], clip);
+    }
+    for (int i = bin_offsets[tile]; i < bin_offsets[tile + 1]; i++) {
+        draw_surface(&job->triangles[bin_triangles[i]], clip, RASTER_PASS_SHADE);
+    }
+}
+
+void render_triangles(triangle_t* triangles, int num_triangles) {
+    if (should_render_textured_triangles()) {
+        draw_surface = draw_textured_surface;
+    } else if (should_render_filled_triangles()) {
+        draw_surface = draw_filled_surface;
+    } else {
+        return;
+    }
+
+    // Untiled fallback draws straight to the whole viewport on this thread
+    if (!tiled_rendering) {
+        if (is_visibility_rendering()) {
+            clear_visibility_rect(get_viewport_rect());
+            for (int i = 0; i < num_triangles; i++) {
+                draw_triangle_visibility(&triangles[i], i, get_viewport_rect());
+            }
+            resolve_visibility_rect(triangles, get_viewport_rect());
+            return;
+        }
+
+        int pass = RASTER_PASS_SINGLE;
+        if (depth_prepass) {
+            for (int i = 0; i < num_triangles; i++) {
+                draw_triangle_depth(&triangles[i], get_viewport_rect());
+            }
+            pass = RASTER_PASS_SHADE;
+        }
+        for (int i = 0; i < num_triangles; i++) {
+            draw_surface(&triangles[i], get_viewport_rect(), pass);
+        }
+        return;
+    }
+
+    bin_triangles_to_tiles(triangles, num_triangles);
+
+    tile_job_t job = { .triangles = triangles };
+    run_parallel_jobs(num_tiles, render_tile_job, &job);
+}
+
+void free_tiles(void) {
+    free(bin_counts);
+    free(bin_offsets);
+    free(bin_triangles);
+    bin_counts = NULL;
+    bin_offsets = NULL;
+    bin_triangles = NULL;
+    bin_capacity = 0;
+}
@@ -0,0 +1,24 @@
+#ifndef TILE_H
+#define TILE_H
+
+#include <stdbool.h>
+#include "display.h"
+#include "triangle.h"
+
+#define TILE_SIZE 64
+
+void init_tiles(int width, int height);
+void set_tiled_rendering(bool enabled);
+bool is_tiled_rendering(void);
+void set_depth_prepass(bool enabled);
+bool is_depth_prepass(void);
+
+void draw_triangle_depth(triangle_t* triangle, rect_t clip);
+void draw_triangle_visibility(triangle_t* triangle, int index, rect_t clip);
+// Rasterizes one triangle inside clip for the given raster pass
+typedef void (*surface_function_t)(triangle_t* triangle, rect_t clip, int pass);
+void render_triangles(triangle_t* triangles, int num_triangles);
+
+void free_tiles(void);
+
+#endif
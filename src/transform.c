@@ -0,0 +1,235 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <SDL2/SDL.h>
+#include "clipping.h"
+#include "transform.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Batched vertex transform
+///////////////////////////////////////////////////////////////////////////////
+// Every mesh keeps its vertex positions as a structure of arrays. With x, y
+// and z in separate aligned streams, one SIMD load brings in the same
+// coordinate of 4 (SSE2) or 8 (AVX2) vertices, and the world-view matrix is
+// applied to all of them with broadcast matrix entries and no shuffles. The
+// same pass tests the camera space results against the frustum and guard
+// band planes and writes one outcode per vertex, so the clipper no longer
+// tests each face's vertices separately.
+//
+// The kernels do the same float operations in the same order as
+// mat4_mul_vec4() and the clipper's plane tests, so their results match the
+// scalar path bit for bit. The transformed vertices are written back as
+// vec4_t because the face loop reads them through vertex indices.
+///////////////////////////////////////////////////////////////////////////////
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define TRANSFORM_X86_KERNELS
+#include <immintrin.h>
+#define TRANSFORM_TARGET(isa) __attribute__((target(isa)))
+#endif
+
+typedef void (*transform_function_t)(const mat4_t* matrix, const vertex_streams_t* streams, const plane_t* planes, vec4_t* out, int* outcodes);
+
+static bool batch_transform = true;
+static transform_function_t transform_kernel = NULL;
+static const char* transform_kernel_name = "scalar";
+
+void init_vertex_streams(vertex_streams_t* streams, const vec3_t* vertices, int count) {
+    int padded_count = (count + VERTEX_BATCH - 1) / VERTEX_BATCH * VERTEX_BATCH;
+    size_t stream_size = sizeof(float) * padded_count;
+
+    // One allocation for the three streams; a whole batch of floats is 32
+    // bytes, so every stream starts aligned
+    streams->allocation = malloc(3 * stream_size + VERTEX_STREAM_ALIGNMENT);
+    float* base = (float*)(((uintptr_t)streams->allocation + VERTEX_STREAM_ALIGNMENT - 1) & ~(uintptr_t)(VERTEX_STREAM_ALIGNMENT - 1));
+    memset(base, 0, 3 * stream_size);
+    streams->x = base;
+    streams->y = base + padded_count;
+    streams->z = base + 2 * padded_count;
+    streams->count = count;
+    streams->padded_count = padded_count;
+
+    for (int i = 0; i < count; i++) {
+        streams->x[i] = vertices[i].x;
+        streams->y[i] = vertices[i].y;
+        streams->z[i] = vertices[i].z;
+    }
+}
+
+void free_vertex_streams(vertex_streams_t* streams) {
+    free(streams->allocation);
+    streams->allocation = NULL;
+    streams->x = streams->y = streams->z = NULL;
+    streams->count = streams->padded_count = 0;
+}
+
+// Reference kernel, one vertex at a time from the streams
+static void transform_vertex_streams_scalar(const mat4_t* matrix, const vertex_streams_t* streams, const plane_t* planes, vec4_t* out, int* outcodes) {
+    const float (*m)[4] = matrix->m;
+    for (int i = 0; i < streams->padded_count; i++) {
+        float x = streams->x[i];
+        float y = streams->y[i];
+        float z = streams->z[i];
+        out[i].x = m[0][0] * x + m[0][1] * y + m[0][2] * z + m[0][3];
+        out[i].y = m[1][0] * x + m[1][1] * y + m[1][2] * z + m[1][3];
+        out[i].z = m[2][0] * x + m[2][1] * y + m[2][2] * z + m[2][3];
+        out[i].w = m[3][0] * x + m[3][1] * y + m[3][2] * z + m[3][3];
+        if (!outcodes) {
+            continue;
+        }
+
+        int outcode = 0;
+        for (int plane = 0; plane < NUM_CLIP_PLANES; plane++) {
+            vec3_t point = planes[plane].point;
+            vec3_t normal = planes[plane].normal;
+            float distance = (out[i].x - point.x) * normal.x + (out[i].y - point.y) * normal.y + (out[i].z - point.z) * normal.z;
+            if (distance <= 0) {
+                outcode |= 1 << plane;
+            }
+        }
+        outcodes[i] = outcode;
+    }
+}
+
+#ifdef TRANSFORM_X86_KERNELS
+
+///////////////////////////////////////////////////////////////////////////////
+// SSE2: 4 vertices per iteration
+///////////////////////////////////////////////////////////////////////////////
+
+TRANSFORM_TARGET("sse2")
+static void transform_vertex_streams_sse2(const mat4_t* matrix, const vertex_streams_t* streams, const plane_t* planes, vec4_t* out, int* outcodes) {
+    __m128 m[4][4];
+    for (int row = 0; row < 4; row++) {
+        for (int column = 0; column < 4; column++) {
+            m[row][column] = _mm_set1_ps(matrix->m[row][column]);
+        }
+    }
+    const __m128 zero = _mm_setzero_ps();
+
+    for (int i = 0; i < streams->padded_count; i += 4) {
+        __m128 x = _mm_load_ps(streams->x + i);
+        __m128 y = _mm_load_ps(streams->y + i);
+        __m128 z = _mm_load_ps(streams->z + i);
+
+        __m128 result[4];
+        for (int row = 0; row < 4; row++) {
+            result[row] = _mm_add_ps(_mm_add_ps(_mm_add_ps(
+                _mm_mul_ps(m[row][0], x), _mm_mul_ps(m[row][1], y)), _mm_mul_ps(m[row][2], z)), m[row][3]);
+        }
+
+        if (outcodes) {
+            __m128i outcode = _mm_setzero_si128();
+            for (int plane = 0; plane < NUM_CLIP_PLANES; plane++) {
+                vec3_t point = planes[plane].point;
+                vec3_t normal = planes[plane].normal;
+                __m128 distance = _mm_add_ps(_mm_add_ps(
+                    _mm_mul_ps(_mm_sub_ps(result[0], _mm_set1_ps(point.x)), _mm_set1_ps(normal.x)),
+                    _mm_mul_ps(_mm_sub_ps(result[1], _mm_set1_ps(point.y)), _mm_set1_ps(normal.y))),
+                    _mm_mul_ps(_mm_sub_ps(result[2], _mm_set1_ps(point.z)), _mm_set1_ps(normal.z)));
+                __m128i outside = _mm_castps_si128(_mm_cmple_ps(distance, zero));
+                outcode = _mm_or_si128(outcode, _mm_and_si128(outside, _mm_set1_epi32(1 << plane)));
+            }
+            _mm_storeu_si128((__m128i*)(outcodes + i), outcode);
+        }
+
+        // Back to one vec4_t per vertex
+        _MM_TRANSPOSE4_PS(result[0], result[1], result[2], result[3]);
+        for (int lane = 0; lane < 4; lane++) {
+            _mm_storeu_ps(&out[i + lane].x, result[lane]);
+        }
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// AVX2: 8 vertices per iteration
+///////////////////////////////////////////////////////////////////////////////
+
+TRANSFORM_TARGET("avx2")
+static void transform_vertex_streams_avx2(const mat4_t* matrix, const vertex_streams_t* streams, const plane_t* planes, vec4_t* out, int* outcodes) {
+    __m256 m[4][4];
+    for (int row = 0; row < 4; row++) {
+        for (int column = 0; column < 4; column++) {
+            m[row][column] = _mm256_set1_ps(matrix->m[row][column]);
+        }
+    }
+    const __m256 zero = _mm256_setzero_ps();
+
+    for (int i = 0; i < streams->padded_count; i += 8) {
+        __m256 x = _mm256_load_ps(streams->x + i);
+        __m256 y = _mm256_load_ps(streams->y + i);
+        __m256 z = _mm256_load_ps(streams->z + i);
+
+        __m256 result[4];
+        for (int row = 0; row < 4; row++) {
+            result[row] = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(
+                _mm256_mul_ps(m[row][0], x), _mm256_mul_ps(m[row][1], y)), _mm256_mul_ps(m[row][2], z)), m[row][3]);
+        }
+
+        if (outcodes) {
+            __m256i outcode = _mm256_setzero_si256();
+            for (int plane = 0; plane < NUM_CLIP_PLANES; plane++) {
+                vec3_t point = planes[plane].point;
+                vec3_t normal = planes[plane].normal;
+                __m256 distance = _mm256_add_ps(_mm256_add_ps(
+                    _mm256_mul_ps(_mm256_sub_ps(result[0], _mm256_set1_ps(point.x)), _mm256_set1_ps(normal.x)),
+                    _mm256_mul_ps(_mm256_sub_ps(result[1], _mm256_set1_ps(point.y)), _mm256_set1_ps(normal.y))),
+                    _mm256_mul_ps(_mm256_sub_ps(result[2], _mm256_set1_ps(point.z)), _mm256_set1_ps(normal.z)));
+                __m256i outside = _mm256_castps_si256(_mm256_cmp_ps(distance, zero, _CMP_LE_OQ));
+                outcode = _mm256_or_si256(outcode, _mm256_and_si256(outside, _mm256_set1_epi32(1 << plane)));
+            }
+            _mm256_storeu_si256((__m256i*)(outcodes + i), outcode);
+        }
+
+        // Back to one vec4_t per vertex, a 4x4 transpose per 128-bit half
+        for (int half = 0; half < 2; half++) {
+            __m128 row_x = half ? _mm256_extractf128_ps(result[0], 1) : _mm256_castps256_ps128(result[0]);
+            __m128 row_y = half ? _mm256_extractf128_ps(result[1], 1) : _mm256_castps256_ps128(result[1]);
+            __m128 row_z = half ? _mm256_extractf128_ps(result[2], 1) : _mm256_castps256_ps128(result[2]);
+            __m128 row_w = half ? _mm256_extractf128_ps(result[3], 1) : _mm256_castps256_ps128(result[3]);
+            _MM_TRANSPOSE4_PS(row_x, row_y, row_z, row_w);
+            vec4_t* vertex = out + i + 4 * half;
+            _mm_storeu_ps(&vertex[0].x, row_x);
+            _mm_storeu_ps(&vertex[1].x, row_y);
+            _mm_storeu_ps(&vertex[2].x, row_z);
+            _mm_storeu_ps(&vertex[3].x, row_w);
+        }
+    }
+}
+
+#endif
+
+void init_vertex_transform(void) {
+    transform_kernel = transform_vertex_streams_scalar;
+    transform_kernel_name = "scalar";
+#ifdef TRANSFORM_X86_KERNELS
+    if (SDL_HasAVX2()) {
+        transform_kernel = transform_vertex_streams_avx2;
+        transform_kernel_name = "AVX2";
+    } else if (SDL_HasSSE2()) {
+        transform_kernel = transform_vertex_streams_sse2;
+        transform_kernel_name = "SSE2";
+    }
+#endif
+}
+
+void set_batch_transform(bool enabled) {
+    batch_transform = enabled;
+}
+
+bool is_batch_transform(void) {
+    return batch_transform;
+}
+
+const char* get_vertex_transform_name(void) {
+    return batch_transform ? transform_kernel_name : "per vertex";
+}
+
+void transform_vertex_streams(const mat4_t* matrix, const vertex_streams_t* streams, vec4_t* out, int* outcodes) {
+    plane_t planes[NUM_CLIP_PLANES];
+    get_clip_planes(planes);
+    if (!transform_kernel) {
+        init_vertex_transform();
+    }
+    transform_kernel(matrix, streams, planes, out, outcodes);
+}
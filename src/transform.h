@@ -0,0 +1,35 @@
+#ifndef TRANSFORM_H
+#define TRANSFORM_H
+
+#include <stdbool.h>
+#include "vector.h"
+#include "matrix.h"
+
+// The batched kernels transform this many vertices per iteration at most
+#define VERTEX_BATCH 8
+#define VERTEX_STREAM_ALIGNMENT 32
+
+// Vertex positions as separate x, y and z streams. Every stream is 32-byte
+// aligned and padded to a whole batch, so the kernels never handle a tail.
+typedef struct {
+    float* x;
+    float* y;
+    float* z;
+    int count;          // Vertices of the mesh
+    int padded_count;   // count rounded up to VERTEX_BATCH
+    void* allocation;
+} vertex_streams_t;
+
+void init_vertex_streams(vertex_streams_t* streams, const vec3_t* vertices, int count);
+void free_vertex_streams(vertex_streams_t* streams);
+
+void init_vertex_transform(void);
+void set_batch_transform(bool enabled);
+bool is_batch_transform(void);
+const char* get_vertex_transform_name(void);
+
+// Transform padded_count vertices to out and write their clip outcodes unless
+// outcodes is NULL. The arrays must hold padded_count entries.
+void transform_vertex_streams(const mat4_t* matrix, const vertex_streams_t* streams, vec4_t* out, int* outcodes);
+
+#endif
@@ -1,7 +1,28 @@
 #include <stdint.h>
+#include <math.h>
 #include "display.h"
-#include "swap.h"
+#include "span.h"
+#include "stats.h"
 #include "triangle.h"
+#include "visibility.h"
+
+// Vertices farther than this from the origin (in pixels) are not rasterized,
+// which keeps every edge function product well inside 64 bits
+#define MAX_SCREEN_COORDINATE 1048576.0f
+
+// Triangles whose covered pixel bounds fit in this many pixels on each side
+// take the micro-triangle path (at most 4 candidate pixel centers)
+#define MICRO_TRIANGLE_SIZE 2
+
+static bool micro_triangles = true;
+
+void set_micro_triangles(bool enabled){
+    micro_triangles = enabled;
+}
+
+bool is_micro_triangles(void){
+    return micro_triangles;
+}
 
 vec3_t get_triangle_normal(vec4_t vertices[3]){
     // Backface culling condition
@@ -29,298 +50,489 @@ void draw_triangle(int x0, int y0, int x1, int y1, int x2, int y2, uint32_t colo
     draw_line(x2, y2, x0, y0, color);
 }
 
-vec3_t barycentric_weights(vec2_t a, vec2_t b, vec2_t c, vec2_t p){
-    // Find the vectors between the vertices ABC and point p
-    vec2_t ac = vec2_sub(c, a);
-    vec2_t ab = vec2_sub(b, a);
-    vec2_t pc = vec2_sub(c, p);
-    vec2_t pb = vec2_sub(b, p);
-    vec2_t ap = vec2_sub(p, a);
+///////////////////////////////////////////////////////////////////////////////
+// Per-triangle plane gradients
+///////////////////////////////////////////////////////////////////////////////
+// Any attribute f that varies linearly in screen space (1/w, u/w, v/w) can be
+// written as a plane anchored at vertex A:
+//
+//     f(x, y) = f(A) + df/dx * (x - A.x) + df/dy * (y - A.y)
+//
+// The two partial derivatives come from the edge equations of the triangle
+// (the same cross products barycentric_weights() used to evaluate per pixel),
+// so they are computed once per triangle. The span loops then step each
+// attribute with a single add per pixel and per row.
+///////////////////////////////////////////////////////////////////////////////
+static triangle_gradient_t triangle_gradient(
+    vec4_t a, vec4_t b, vec4_t c,
+    float value_a, float value_b, float value_c
+){
+    // Edge vectors from vertex A to B and C
+    float ab_x = b.x - a.x;
+    float ab_y = b.y - a.y;
+    float ac_x = c.x - a.x;
+    float ac_y = c.y - a.y;
+
+    // Twice the signed area of the triangle ABC
+    float area = ab_x * ac_y - ac_x * ab_y;
+
+    float delta_ab = value_b - value_a;
+    float delta_ac = value_c - value_a;
+
+    triangle_gradient_t gradient = {
+        .origin = value_a,
+        .dx = (delta_ab * ac_y - delta_ac * ab_y) / area,
+        .dy = (delta_ac * ab_x - delta_ab * ac_x) / area
+    };
+    return gradient;
+}
 
-    // Area of the full parallelogram (triangle ABC) using cross product
-    float area_parallelogram_abc = (ac.x * ab.y - ac.y * ab.x);
+// Value of the gradient plane at the center of pixel (x, y)
+float triangle_gradient_at(triangle_gradient_t gradient, vec4_t a, int x, int y){
+    return gradient.origin + gradient.dx * (x + 0.5 - a.x) + gradient.dy * (y + 0.5 - a.y);
+}
 
-    // Alpha = area of parallelogram PBC / area of full paralellogram ABC
-    float alpha = (pc.x * pb.y - pc.y * pb.x) / area_parallelogram_abc;
+// 1/w of the triangle plane at x = 0 on row y, see triangle_reciprocal_w_at()
+float triangle_row_reciprocal_w(const triangle_setup_t* setup, int y){
+    return triangle_gradient_at(setup->reciprocal_w, setup->point_a, 0, y);
+}
 
-    // Beta = area of parallelogram PBC / area of full paralellogram ABC
-    float beta = (ac.x * ap.y - ac.y * ap.x) / area_parallelogram_abc;
+///////////////////////////////////////////////////////////////////////////////
+// Fixed-point edge setup with the top-left fill rule
+///////////////////////////////////////////////////////////////////////////////
+// Vertices are snapped to 28.4 fixed point. A pixel is covered when its
+// center lies inside all three edges. Centers exactly on an edge belong to
+// the triangle only if that edge is a top edge (horizontal, interior below)
+// or a left edge (interior to its right), so a pixel on an edge shared by
+// two triangles is shaded exactly once, with no cracks and no double hits.
+//
+// Each edge i->j is kept as E(x, y) = step_x * x + step_y * y + origin for
+// pixel coordinates (x, y), with the center offset and fill rule bias folded
+// into origin, so "inside" is simply E(x, y) > 0.
+///////////////////////////////////////////////////////////////////////////////
+static triangle_edge_t triangle_edge(int xi, int yi, int xj, int yj){
+    int64_t a = -(int64_t)(yj - yi);
+    int64_t b = (int64_t)(xj - xi);
+
+    // Top-left edges own the pixels whose center falls exactly on them
+    bool is_top_left = (a > 0) || (a == 0 && b > 0);
+
+    triangle_edge_t edge = {
+        .step_x = a * SUBPIXEL_ONE,
+        .step_y = b * SUBPIXEL_ONE,
+        .origin = a * (SUBPIXEL_HALF - xi) + b * (SUBPIXEL_HALF - yi) + (is_top_left ? 1 : 0)
+    };
+    return edge;
+}
 
-    // Since alpha + beta + gamma = 1;
-    float gamma = 1.0 - alpha - beta;
+static bool micro_triangle_spans(const triangle_setup_t* setup, int spans[MICRO_TRIANGLE_SIZE][2]);
 
-    vec3_t weights = { alpha, beta, gamma};
-    return weights;
+// A triangle is drawn once per tile it overlaps and again in the shade pass of
+// the depth pre-pass. Only the tile holding the top-left corner of its
+// on-screen bounding box (the first tile it is binned to) counts it in the
+// triangle class stats, outside the shade pass, so each one is counted once.
+static bool triangle_counts_stats(const triangle_setup_t* setup, vec4_t* points[3]){
+    if (setup->pass == RASTER_PASS_SHADE) {
+        return false;
+    }
+    float min_x = points[0]->x;
+    float min_y = points[0]->y;
+    for (int i = 1; i < 3; i++) {
+        if (points[i]->x < min_x) min_x = points[i]->x;
+        if (points[i]->y < min_y) min_y = points[i]->y;
+    }
+    rect_t viewport = get_viewport_rect();
+    int x = min_x < viewport.x_min ? viewport.x_min : min_x >= viewport.x_max ? viewport.x_max - 1 : (int)min_x;
+    int y = min_y < viewport.y_min ? viewport.y_min : min_y >= viewport.y_max ? viewport.y_max - 1 : (int)min_y;
+    return x >= setup->clip.x_min && x < setup->clip.x_max && y >= setup->clip.y_min && y < setup->clip.y_max;
 }
 
+// Count the triangle as full setup, micro or empty from its unclipped pixel
+// bounds, whichever path the tiles end up taking for their part of it
+static void count_triangle_class(const triangle_setup_t* setup, int64_t x_min, int64_t y_min, int64_t x_max, int64_t y_max){
+    if (!micro_triangles || x_max - x_min >= MICRO_TRIANGLE_SIZE || y_max - y_min >= MICRO_TRIANGLE_SIZE) {
+        add_stat(STAT_TRIANGLES_FULL_SETUP, 1);
+        return;
+    }
+    triangle_setup_t bounds = *setup;
+    bounds.x_min = (int)x_min;
+    bounds.y_min = (int)y_min;
+    bounds.x_max = (int)x_max;
+    bounds.y_max = (int)y_max;
+    int spans[MICRO_TRIANGLE_SIZE][2];
+    add_stat(micro_triangle_spans(&bounds, spans) ? STAT_TRIANGLES_MICRO : STAT_TRIANGLES_EMPTY, 1);
+}
 
-//         (x0, y0)
-//
-// (x1, y1)
-//                     (x2, y2)
+// Snap the vertices, build the edge functions and the covered pixel bounds.
+// Returns false for zero-area triangles and triangles outside the clip rect.
+static bool triangle_setup_edges(triangle_setup_t* setup, vec4_t* a, vec4_t* b, vec4_t* c){
+    vec4_t* points[3] = { a, b, c };
+    bool counts_stats = triangle_counts_stats(setup, points);
+    int fixed_x[3];
+    int fixed_y[3];
+    for (int i = 0; i < 3; i++) {
+        if (!(fabsf(points[i]->x) < MAX_SCREEN_COORDINATE && fabsf(points[i]->y) < MAX_SCREEN_COORDINATE)) {
+            return false;
+        }
+        fixed_x[i] = (int)lrintf(points[i]->x * SUBPIXEL_ONE);
+        fixed_y[i] = (int)lrintf(points[i]->y * SUBPIXEL_ONE);
 
-void draw_filled_triangle(
-    int x0, int y0, float z0, float w0, 
-    int x1, int y1, float z1, float w1,
-    int x2, int y2, float z2, float w2,
-    uint32_t color
-){
-    // TODO: Replace to use Z-buffer
+        // Interpolate from the snapped position so attributes match coverage
+        points[i]->x = (float)fixed_x[i] / SUBPIXEL_ONE;
+        points[i]->y = (float)fixed_y[i] / SUBPIXEL_ONE;
+    }
 
-    if (y0 > y1) {
-        int_swap(&y0, &y1);
-        int_swap(&x0, &x1);
-        float_swap(&z0, &z1);
-        float_swap(&w0, &w1);
+    // Twice the signed area; flip the winding so the interior is always positive
+    int64_t area = (int64_t)(fixed_x[1] - fixed_x[0]) * (fixed_y[2] - fixed_y[0]) -
+                   (int64_t)(fixed_y[1] - fixed_y[0]) * (fixed_x[2] - fixed_x[0]);
+    if (area == 0) {
+        if (counts_stats) add_stat(STAT_TRIANGLES_EMPTY, 1);
+        return false;
     }
-    if (y1 > y2) {
-        int_swap(&y1, &y2);
-        int_swap(&x1, &x2);
-        float_swap(&z1, &z2);
-        float_swap(&w1, &w2);
+    int i1 = area > 0 ? 1 : 2;
+    int i2 = area > 0 ? 2 : 1;
+
+    setup->edges[0] = triangle_edge(fixed_x[0], fixed_y[0], fixed_x[i1], fixed_y[i1]);
+    setup->edges[1] = triangle_edge(fixed_x[i1], fixed_y[i1], fixed_x[i2], fixed_y[i2]);
+    setup->edges[2] = triangle_edge(fixed_x[i2], fixed_y[i2], fixed_x[0], fixed_y[0]);
+
+    // Range of pixels whose centers fall inside the vertex bounding box
+    int min_x = fixed_x[0], max_x = fixed_x[0], min_y = fixed_y[0], max_y = fixed_y[0];
+    for (int i = 1; i < 3; i++) {
+        if (fixed_x[i] < min_x) min_x = fixed_x[i];
+        if (fixed_x[i] > max_x) max_x = fixed_x[i];
+        if (fixed_y[i] < min_y) min_y = fixed_y[i];
+        if (fixed_y[i] > max_y) max_y = fixed_y[i];
     }
-    if (y0 > y1) {
-        int_swap(&y0, &y1);
-        int_swap(&x0, &x1);
-        float_swap(&z0, &z1);
-        float_swap(&w0, &w1);
+    int64_t x_min = ceil_div(min_x - SUBPIXEL_HALF, SUBPIXEL_ONE);
+    int64_t x_max = floor_div(max_x - SUBPIXEL_HALF, SUBPIXEL_ONE);
+    int64_t y_min = ceil_div(min_y - SUBPIXEL_HALF, SUBPIXEL_ONE);
+    int64_t y_max = floor_div(max_y - SUBPIXEL_HALF, SUBPIXEL_ONE);
+    if (x_min > x_max || y_min > y_max) {
+        // Slivers between pixel centers cover nothing anywhere on screen
+        if (counts_stats) add_stat(STAT_TRIANGLES_EMPTY, 1);
+        return false;
+    }
+    if (counts_stats) {
+        count_triangle_class(setup, x_min, y_min, x_max, y_max);
     }
 
-    vec4_t point_a = {x0, y0, z0, w0};
-    vec4_t point_b = {x1, y1, z1, w1};
-    vec4_t point_c = {x2, y2, z2, w2};
-
-    // Flat bottom
-
-    float inv_slope_1 = 0;
-    float inv_slope_2 = 0;
+    rect_t clip = setup->clip;
+    setup->x_min = x_min < clip.x_min ? clip.x_min : (int)x_min;
+    setup->y_min = y_min < clip.y_min ? clip.y_min : (int)y_min;
+    setup->x_max = x_max > clip.x_max - 1 ? clip.x_max - 1 : (int)x_max;
+    setup->y_max = y_max > clip.y_max - 1 ? clip.y_max - 1 : (int)y_max;
+    return setup->x_min <= setup->x_max && setup->y_min <= setup->y_max;
+}
 
-    if ( y1 - y0 != 0) inv_slope_1 = (float)(x1 - x0) / abs(y1 - y0);
-    if ( y2 - y0 != 0) inv_slope_2 = (float)(x2 - x0) / abs(y2 - y0);
+// Render target of each raster pass; the kernels are specialized per pass
+static void triangle_setup_pass(triangle_setup_t* setup, int pass){
+    setup->pass = pass;
+    setup->target_buffer = pass == RASTER_PASS_VISIBILITY ? get_visibility_buffer() : get_color_buffer();
+}
 
-    if (y1 - y0 != 0) {
-        for(int y = y0; y <= y1; y++) {
-            int x_start = x1 + (y-y1) * (inv_slope_1);
-            int x_end = x0 + (y- y0) * (inv_slope_2);
+// Nearest depth any pixel of the triangle gets inside its pixel bounds.
+// triangle_reciprocal_w_at() is monotonic in x and in the row value, which is
+// monotonic in y, so its largest value is at a corner of the bounds. That is
+// exactly the depth the kernels would compute there, so no slack is needed.
+static float triangle_min_depth(const triangle_setup_t* setup){
+    float dx = setup->reciprocal_w.dx;
+    float row_min = triangle_row_reciprocal_w(setup, setup->y_min);
+    float row_max = triangle_row_reciprocal_w(setup, setup->y_max);
+    float corners[4] = {
+        triangle_reciprocal_w_at(row_min, dx, setup->x_min),
+        triangle_reciprocal_w_at(row_min, dx, setup->x_max),
+        triangle_reciprocal_w_at(row_max, dx, setup->x_min),
+        triangle_reciprocal_w_at(row_max, dx, setup->x_max)
+    };
+    float max_reciprocal_w = corners[0];
+    for (int i = 1; i < 4; i++) {
+        if (corners[i] > max_reciprocal_w) max_reciprocal_w = corners[i];
+    }
+    return 1.0 - max_reciprocal_w;
+}
 
-            if (x_end < x_start) {
-                int_swap(&x_start, &x_end);
-            }
+// Whether pixels no nearer than min_depth all fail the depth test of the pass
+// against a block whose farthest depth is max_depth. The shade pass accepts
+// pixels equal to the stored depth, so only strictly farther ones are hidden.
+static bool is_hidden_behind(float min_depth, float max_depth, int pass){
+    return pass == RASTER_PASS_SHADE ? min_depth > max_depth : min_depth >= max_depth;
+}
 
-            for(int x = x_start; x < x_end; x++) {
-                draw_triangle_pixel(x, y, color, point_a, point_b, point_c);
+// Test the triangle bounding box against the coarse Hi-Z blocks. The triangle
+// is hidden if its nearest depth is behind the farthest depth of every block.
+static bool triangle_is_occluded(triangle_setup_t* setup){
+    int block_x_min = setup->x_min / HIZ_BLOCK_SIZE;
+    int block_y_min = setup->y_min / HIZ_BLOCK_SIZE;
+    int block_x_max = setup->x_max / HIZ_BLOCK_SIZE;
+    int block_y_max = setup->y_max / HIZ_BLOCK_SIZE;
+
+    for (int block_y = block_y_min; block_y <= block_y_max; block_y++) {
+        for (int block_x = block_x_min; block_x <= block_x_max; block_x++) {
+            if (!is_hidden_behind(setup->min_depth, update_hiz_block(block_x, block_y), setup->pass)) {
+                return false;
             }
         }
     }
-    
-    // Flat top
-
-    inv_slope_1 = 0;
-    inv_slope_2 = 0;
-
-    if( y2 - y1 != 0 ) inv_slope_1 = (float)(x2 - x1) / abs(y2 -y1);
-    if( y2 - y0 != 0 ) inv_slope_2 = (float)(x2 - x0) / abs(y2 - y0);
+    add_stat(STAT_HIZ_TRIANGLES_REJECTED, 1);
+    add_stat(STAT_HIZ_BLOCKS_SKIPPED, (block_x_max - block_x_min + 1) * (block_y_max - block_y_min + 1));
+    return true;
+}
 
-    if( y2- y1 != 0) {
-        for( int y=y1; y <= y2; y++){
-            int x_start = x1 + (y - y1) * inv_slope_1;
-            int x_end = x0 + (y - y0) * inv_slope_2;
+// Scissor a span to the clip rectangle and hand it to the span kernel. With
+// Hi-Z on, the span is cut at block boundaries and pieces that lie behind
+// their block are skipped before any pixel work is done.
+static void draw_clipped_span(
+    span_function_t draw_span, int y, int x_start, int x_end, triangle_setup_t* setup
+){
+    if (x_start < setup->clip.x_min) x_start = setup->clip.x_min;
+    if (x_end > setup->clip.x_max) x_end = setup->clip.x_max;
+    if (x_start >= x_end) {
+        return;
+    }
 
-            if(x_end < x_start) {
-                int_swap(&x_start, &x_end);
-            }
+    if (!is_hiz_enabled()) {
+        setup->fragments += draw_span(y, x_start, x_end, setup);
+        setup->tested_fragments += x_end - x_start;
+        return;
+    }
 
-            for(int x = x_start; x < x_end; x++) {
-                draw_triangle_pixel(x, y, color, point_a, point_b, point_c);
+    int block_y = y / HIZ_BLOCK_SIZE;
+    float row_reciprocal_w = triangle_row_reciprocal_w(setup, y);
+    int run_start = x_start;
+    int block_end;
+    for (int block_start = x_start; block_start < x_end; block_start = block_end) {
+        block_end = (block_start / HIZ_BLOCK_SIZE + 1) * HIZ_BLOCK_SIZE;
+        if (block_end > x_end) block_end = x_end;
+
+        // Depth is monotonic along the span, so its nearest value is at an end,
+        // computed exactly as the kernels compute it
+        float reciprocal_w_start = triangle_reciprocal_w_at(row_reciprocal_w, setup->reciprocal_w.dx, block_start);
+        float reciprocal_w_end = triangle_reciprocal_w_at(row_reciprocal_w, setup->reciprocal_w.dx, block_end - 1);
+        float segment_min_depth = 1.0 - (reciprocal_w_start > reciprocal_w_end ? reciprocal_w_start : reciprocal_w_end);
+
+        if (is_hidden_behind(segment_min_depth, get_hiz_max_depth(block_start / HIZ_BLOCK_SIZE, block_y), setup->pass)) {
+            // Draw what was visible so far and skip this hidden piece
+            if (run_start < block_start) {
+                setup->fragments += draw_span(y, run_start, block_start, setup);
+                setup->tested_fragments += block_start - run_start;
+                if (setup->pass != RASTER_PASS_SHADE) mark_hiz_dirty(y, run_start, block_start);
             }
+            run_start = block_end;
+            setup->hiz_blocks_skipped++;
+            setup->hiz_pixels_skipped += block_end - block_start;
         }
     }
-
+    if (run_start < x_end) {
+        setup->fragments += draw_span(y, run_start, x_end, setup);
+        setup->tested_fragments += x_end - run_start;
+        if (setup->pass != RASTER_PASS_SHADE) mark_hiz_dirty(y, run_start, x_end);
+    }
 }
 
-void draw_triangle_pixel(
-    int x, int y, uint32_t color, 
-    vec4_t point_a, vec4_t point_b, vec4_t point_c
-){
-    // Create three vec2 to find the interpolation
-    vec2_t p = {x, y};
-    vec2_t a = vec2_from_vec4(point_a);
-    vec2_t b = vec2_from_vec4(point_b);
-    vec2_t c = vec2_from_vec4(point_c);
+// Fold the per-triangle counters into the frame stats
+static void add_raster_stats(const triangle_setup_t* setup){
+    int fragment_counter = STAT_SHADED_FRAGMENTS;
+    if (setup->pass == RASTER_PASS_DEPTH) fragment_counter = STAT_DEPTH_FRAGMENTS;
+    if (setup->pass == RASTER_PASS_VISIBILITY) fragment_counter = STAT_VISIBILITY_FRAGMENTS;
+    add_stat(fragment_counter, setup->fragments);
+    add_stat(STAT_DEPTH_TESTED_FRAGMENTS, setup->tested_fragments);
+    add_stat(STAT_DEPTH_REJECTED_FRAGMENTS, setup->tested_fragments - setup->fragments);
+    add_stat(STAT_HIZ_BLOCKS_SKIPPED, setup->hiz_blocks_skipped);
+    add_stat(STAT_HIZ_PIXELS_SKIPPED, setup->hiz_pixels_skipped);
+}
 
-    vec3_t weights = barycentric_weights(a, b, c, p);
+// Walk the covered rows and solve the three edge functions for the first
+// and last covered pixel of each row, so only covered pixels reach the kernels
+static void rasterize_triangle(span_function_t draw_span, triangle_setup_t* setup){
+    for (int y = setup->y_min; y <= setup->y_max; y++) {
+        int64_t x_start = setup->x_min;
+        int64_t x_end = setup->x_max + 1;
+
+        for (int i = 0; i < 3; i++) {
+            triangle_edge_t* edge = &setup->edges[i];
+            int64_t row_value = edge->origin + edge->step_y * y;
+
+            // Solve row_value + step_x * x > 0 for x
+            if (edge->step_x > 0) {
+                int64_t first = floor_div(-row_value, edge->step_x) + 1;
+                if (first > x_start) x_start = first;
+            } else if (edge->step_x < 0) {
+                int64_t end = ceil_div(row_value, -edge->step_x);
+                if (end < x_end) x_end = end;
+            } else if (row_value <= 0) {
+                x_end = x_start;
+            }
+        }
 
-    float alpha = weights.x;
-    float beta = weights.y;
-    float gamma = weights.z;
+        if (x_start < x_end) {
+            draw_clipped_span(draw_span, y, (int)x_start, (int)x_end, setup);
+        }
+    }
 
-    // Interpolate the value of 1/w for the current pixel
-    float interpolated_reciprocal_w = (1 / point_a.w) * alpha + (1 / point_b.w) * beta + (1 / point_c.w) * gamma;
+    add_raster_stats(setup);
+}
 
-    // Adjust 1/w so the pixels that are closer to the camera have smaller values
-    interpolated_reciprocal_w = 1.0 - interpolated_reciprocal_w;
+///////////////////////////////////////////////////////////////////////////////
+// Micro-triangle path
+///////////////////////////////////////////////////////////////////////////////
+// Dense meshes far from the camera are mostly triangles that touch a pixel
+// or two, and for those the per-triangle setup costs more than the fill: the
+// span solver does six 64-bit divisions per row, the Hi-Z test walks the
+// bounding box and the gradients are computed even when no pixel center ends
+// up inside. Triangles whose covered pixel bounds are at most
+// MICRO_TRIANGLE_SIZE wide and tall instead evaluate the three edge functions
+// at each candidate center directly. Triangles that cover no center are
+// dropped before any gradient or texture setup; the others hand their one or
+// two short runs straight to the span kernel.
+///////////////////////////////////////////////////////////////////////////////
+static bool is_micro_triangle(const triangle_setup_t* setup){
+    return micro_triangles &&
+        setup->x_max - setup->x_min < MICRO_TRIANGLE_SIZE &&
+        setup->y_max - setup->y_min < MICRO_TRIANGLE_SIZE;
+}
 
-    // Only draw the pixel if the depth value is less than the one previously stored in z-buffer
-    if (interpolated_reciprocal_w < get_zbuffer_at(x, y)) {
-        draw_pixel(x, y, color);
-        update_zbuffer_at(x, y, interpolated_reciprocal_w);
+// Test the candidate pixel centers and record the covered run of each row
+// (covered pixels of a row are contiguous, the triangle being convex).
+// Returns false when no pixel center is covered.
+static bool micro_triangle_spans(const triangle_setup_t* setup, int spans[MICRO_TRIANGLE_SIZE][2]){
+    bool covered_any = false;
+    for (int row = 0; row <= setup->y_max - setup->y_min; row++) {
+        int y = setup->y_min + row;
+        spans[row][0] = setup->x_max + 1;
+        spans[row][1] = setup->x_min;
+        for (int x = setup->x_min; x <= setup->x_max; x++) {
+            bool inside = true;
+            for (int i = 0; i < 3 && inside; i++) {
+                const triangle_edge_t* edge = &setup->edges[i];
+                inside = edge->origin + edge->step_x * x + edge->step_y * y > 0;
+            }
+            if (inside) {
+                if (x < spans[row][0]) spans[row][0] = x;
+                spans[row][1] = x + 1;
+                covered_any = true;
+            }
+        }
     }
+    return covered_any;
 }
 
+static void rasterize_micro_triangle(
+    span_function_t draw_span, triangle_setup_t* setup, int spans[MICRO_TRIANGLE_SIZE][2]
+){
+    for (int row = 0; row <= setup->y_max - setup->y_min; row++) {
+        if (spans[row][0] < spans[row][1]) {
+            draw_clipped_span(draw_span, setup->y_min + row, spans[row][0], spans[row][1], setup);
+        }
+    }
+    add_raster_stats(setup);
+}
 
-// Function to draw the textured pixel at position x and y using interpolation
-void draw_triangle_texel(
-    int x, int y, upng_t *texture, 
-    vec4_t point_a, vec4_t point_b, vec4_t point_c,
-    tex2_t a_uv, tex2_t b_uv, tex2_t c_uv
-){  
-    vec2_t p = {x, y};
-    vec2_t a = vec2_from_vec4(point_a);
-    vec2_t b = vec2_from_vec4(point_b);
-    vec2_t c = vec2_from_vec4(point_c);
-
-
-    vec3_t weights = barycentric_weights(a, b, c, p);
-
-    float alpha = weights.x;
-    float beta = weights.y;
-    float gamma = weights.z;
-
-    // Variables to store the interpolated values of U, V and also w for the current pixel
-    float interpolated_u;
-    float interpolated_v;
-    float interpolated_reciprocal_w;
-
-    // Perform the interpolation of all U/w, V/w values using barycentric weights and a factor of 1/w
-    interpolated_u = (a_uv.u / point_a.w) * alpha + (b_uv.u / point_b.w) * beta + (c_uv.u / point_c.w) * gamma;
-    interpolated_v = (a_uv.v / point_a.w) * alpha + (b_uv.v / point_b.w) * beta + (c_uv.v / point_c.w) * gamma;
-
-    // Also interpolate the value of 1/w for the current pixel
-    interpolated_reciprocal_w = (1 / point_a.w) * alpha + (1 / point_b.w) * beta + (1 / point_c.w) * gamma;
+void draw_filled_triangle(
+    float x0, float y0, float z0, float w0,
+    float x1, float y1, float z1, float w1,
+    float x2, float y2, float z2, float w2,
+    uint32_t color, rect_t clip, int pass
+){
+    vec4_t point_a = {x0, y0, z0, w0};
+    vec4_t point_b = {x1, y1, z1, w1};
+    vec4_t point_c = {x2, y2, z2, w2};
 
-    // Now we can divide back both interpolated values by 1/w
-    interpolated_u /= interpolated_reciprocal_w;
-    interpolated_v /= interpolated_reciprocal_w;
+    triangle_setup_t setup = {
+        .color = color,
+        .clip = clip
+    };
+    triangle_setup_pass(&setup, pass);
 
-    // Get the mesh texture width and height dimensionts
-    int texture_width = upng_get_width(texture);
-    int texture_height = upng_get_height(texture);
+    // Nothing to do for zero-area triangles or ones outside the clip rectangle
+    if (!triangle_setup_edges(&setup, &point_a, &point_b, &point_c)) {
+        return;
+    }
 
-    // Map the UV coordinates to the full texture width and height
-    int tex_x = abs((int)(interpolated_u * texture_width)) % texture_width;
-    int tex_y = abs((int)(interpolated_v * texture_height)) % texture_height;
+    // Tiny triangles that miss every pixel center stop here, before any gradient
+    bool micro = is_micro_triangle(&setup);
+    int micro_spans[MICRO_TRIANGLE_SIZE][2];
+    if (micro && !micro_triangle_spans(&setup, micro_spans)) {
+        return;
+    }
 
-    // Adjust 1/w so pixel closer to camera have smaller values
-    interpolated_reciprocal_w = 1.0 - interpolated_reciprocal_w;
+    // Compute the 1/w plane gradient once for the whole triangle
+    setup.point_a = point_a;
+    setup.reciprocal_w = triangle_gradient(point_a, point_b, point_c, 1 / w0, 1 / w1, 1 / w2);
 
-    // Only draw pixel if depth value is less than previously stored in the z-buffer
-    if ( interpolated_reciprocal_w < get_zbuffer_at(x, y) ) {
-        // Get the buffer of colors
-        uint32_t* texture_buffer = (uint32_t* )upng_get_buffer(texture);
+    // Flat span kernel specialized for this pass; the depth pre-pass of
+    // textured triangles goes through it too, without color
+    span_function_t draw_span = get_flat_span_kernel(pass);
+    if (micro) {
+        rasterize_micro_triangle(draw_span, &setup, micro_spans);
+        return;
+    }
+    setup.min_depth = triangle_min_depth(&setup);
 
-        // Check tex_x, tex_y boundings less than, greater than
-        draw_pixel(x, y, texture_buffer[(texture_width * tex_y) + tex_x] );
-        
-        // Update the z-buffer value with the 1/w of this current pixel
-        update_zbuffer_at(x, y, interpolated_reciprocal_w);
+    // Reject the whole triangle if it is behind everything under its bounding box
+    if (is_hiz_enabled() && triangle_is_occluded(&setup)) {
+        return;
     }
-}
-    
 
-// Drawing a textured triangle with flat-top/flat-bottom method
+    rasterize_triangle(draw_span, &setup);
+}
 
 void draw_textured_triangle(
-    int x0, int y0, float z0, float w0,float u0, float v0,
-    int x1, int y1, float z1, float w1, float u1, float v1,
-    int x2, int y2, float z2, float w2, float u2, float v2,
-    upng_t* texture
-){ 
-    // Sort the vertices by y-coordinate ascending (y0 < y1 < y2)
-    if (y0 > y1) {
-        int_swap(&y0, &y1);
-        int_swap(&x0, &x1);
-        float_swap(&z0, &z1);
-        float_swap(&w0, &w1);
-        float_swap(&u0, &u1);
-        float_swap(&v0, &v1);
-    }
-    if (y1 > y2){
-        int_swap(&y1, &y2);
-        int_swap(&x1, &x2);
-        float_swap(&z1, &z2);
-        float_swap(&w1, &w2);
-        float_swap(&u1, &u2);
-        float_swap(&v1, &v2);
-    }
-    if (y0 > y1){
-        int_swap(&y0, &y1);
-        int_swap(&x0, &x1);
-        float_swap(&z0, &z1);
-        float_swap(&w0, &w1);
-        float_swap(&u0, &u1);
-        float_swap(&v0, &v1);
-    }
-
+    float x0, float y0, float z0, float w0, float u0, float v0,
+    float x1, float y1, float z1, float w1, float u1, float v1,
+    float x2, float y2, float z2, float w2, float u2, float v2,
+    texture_t* texture, rect_t clip, int pass
+){
     // Flip the v component to account for inverted UV-coordinate (V +ve downstairs)
     v0 = 1.0 - v0;
     v1 = 1.0 - v1;
     v2 = 1.0 - v2;
 
-    // Create vector points after we sort the vertices
     vec4_t point_a = {x0, y0, z0, w0};
     vec4_t point_b = {x1, y1, z1, w1};
     vec4_t point_c = {x2, y2, z2, w2};
-    tex2_t a_uv = {u0, v0};
-    tex2_t b_uv = {u1, v1};
-    tex2_t c_uv = {u2, v2};
-
-    // Render upper-part (flat-bottom)
-    float inv_slope_1 = 0;
-    float inv_slope_2 = 0;
-
-    if (y1 - y0 != 0) inv_slope_1 = (float)( x1 - x0 ) / abs( y1 - y0 );
-    if (y2 - y0 != 0) inv_slope_2 = (float)( x2 - x0 ) / abs( y2 - y0 );
-
-    if (y1 - y0 != 0) {
-        for( int y = y0; y <= y1; y++ ) {
-            int x_start = x1 + (y - y1) * (inv_slope_1);
-            int x_end = x0 + (y - y0) * (inv_slope_2);
 
-            if(x_end < x_start) {
-                int_swap(&x_start, &x_end);
-            }   
+    triangle_setup_t setup = {
+        .clip = clip
+    };
+    triangle_setup_pass(&setup, pass);
 
-            for(int x = x_start; x < x_end; x++){
-                draw_triangle_texel(x, y, texture, point_a, point_b, point_c, a_uv, b_uv, c_uv);
-            }
-        }
+    // Nothing to do for zero-area triangles or ones outside the clip rectangle
+    if (!triangle_setup_edges(&setup, &point_a, &point_b, &point_c)) {
+        return;
     }
 
+    // Tiny triangles that miss every pixel center stop here, before any gradient
+    bool micro = is_micro_triangle(&setup);
+    int micro_spans[MICRO_TRIANGLE_SIZE][2];
+    if (micro && !micro_triangle_spans(&setup, micro_spans)) {
+        return;
+    }
 
-    // Render bottom-part (flat-top)
-
-    inv_slope_1 = 0;
-    inv_slope_2 = 0;
-
-    if (y2 - y1 != 0) inv_slope_1 = (float)( x2 - x1 ) / abs( y2 - y1 );
-    if (y2 - y0 != 0) inv_slope_2 = (float)( x2 - x0 ) / abs( y2 - y0 );
-
-    if (y2 - y1 != 0) {
-        for( int y = y1; y <= y2; y++ ) {
-            int x_start = x1 + (y - y1) * (inv_slope_1);
-            int x_end = x0 + (y - y0) * (inv_slope_2);
-
-            if(x_end < x_start) {
-                int_swap(&x_start, &x_end);
-            }   
+    // Sample the mip level whose texels best match the covered pixels
+    float screen_area = fabsf((point_b.x - point_a.x) * (point_c.y - point_a.y) - (point_c.x - point_a.x) * (point_b.y - point_a.y));
+    float uv_area = fabsf((u1 - u0) * (v2 - v0) - (u2 - u0) * (v1 - v0));
+    const texture_level_t* level = &texture->levels[select_texture_level(texture, uv_area, screen_area)];
+
+    // Compute the 1/w, u/w and v/w plane gradients once for the whole triangle
+    setup.point_a = point_a;
+    setup.reciprocal_w = triangle_gradient(point_a, point_b, point_c, 1 / w0, 1 / w1, 1 / w2);
+    setup.u_over_w = triangle_gradient(point_a, point_b, point_c, u0 / w0, u1 / w1, u2 / w2);
+    setup.v_over_w = triangle_gradient(point_a, point_b, point_c, v0 / w0, v1 / w1, v2 / w2);
+    setup.texture_level = level;
+
+    // Textured span kernel specialized for this pass and the texture
+    span_function_t draw_span = get_textured_span_kernel(pass, texture);
+    if (micro) {
+        rasterize_micro_triangle(draw_span, &setup, micro_spans);
+        return;
+    }
+    setup.min_depth = triangle_min_depth(&setup);
 
-            for(int x = x_start; x < x_end; x++){
-                // TODO:
-                // Draw our pixel with the color that comes from the texture
-                draw_triangle_texel(x, y, texture, point_a, point_b, point_c, a_uv, b_uv, c_uv);
-            }
-        }
+    // Reject the whole triangle if it is behind everything under its bounding box
+    if (is_hiz_enabled() && triangle_is_occluded(&setup)) {
+        return;
     }
 
+    rasterize_triangle(draw_span, &setup);
 }
-
@@ -2,47 +2,109 @@
 #define TRIANGLE_H
 
 #include <stdint.h>
+#include <stdbool.h>
+#include "display.h"
 #include "vector.h"
 #include "texture.h"
 #include "upng.h"
 
+// Sub-pixel precision of the rasterizer: 28.4 fixed point, 1/16th of a pixel
+#define SUBPIXEL_BITS 4
+#define SUBPIXEL_ONE (1 << SUBPIXEL_BITS)
+#define SUBPIXEL_HALF (SUBPIXEL_ONE / 2)
+
+// A triangle as three indices into the vertex table of its mesh
 typedef struct {
-    int a;
-    int b;
-    int c;
-    tex2_t a_uv;
-    tex2_t b_uv;
-    tex2_t c_uv;
-    uint32_t color;
+    uint32_t a;
+    uint32_t b;
+    uint32_t c;
 } face_t;
 
 typedef struct{
     vec4_t points[3];
     tex2_t texcoords[3];
     uint32_t color;
-    upng_t* texture;
+    texture_t* texture;
 } triangle_t;
 
+// Which pass of the frame a triangle is drawn for. Single-pass rendering
+// depth tests, shades and writes depth. With the depth pre-pass, the depth
+// pass only writes depth and the shade pass only shades the pixels whose
+// depth matches the stored one. The visibility pass writes triangle ids
+// instead of colors (see visibility.c).
+enum raster_pass {
+    RASTER_PASS_SINGLE,
+    RASTER_PASS_DEPTH,
+    RASTER_PASS_SHADE,
+    RASTER_PASS_VISIBILITY,
+    NUM_RASTER_PASSES
+};
+
+// Linear screen-space attribute: value at vertex A plus per-pixel x/y steps
+typedef struct {
+    float origin;
+    float dx;
+    float dy;
+} triangle_gradient_t;
+
+// Edge function in 28.4 fixed point: pixel (x, y) is inside when
+// step_x * x + step_y * y + origin > 0
+typedef struct {
+    int64_t step_x;
+    int64_t step_y;
+    int64_t origin;
+} triangle_edge_t;
+
+// Everything the span loops need, computed once per triangle
+typedef struct {
+    vec4_t point_a;
+    triangle_gradient_t reciprocal_w;
+    triangle_gradient_t u_over_w;
+    triangle_gradient_t v_over_w;
+    uint32_t color;
+    const texture_level_t* texture_level;
+    triangle_edge_t edges[3];
+    rect_t clip;
+    int x_min;
+    int y_min;
+    int x_max;
+    int y_max;
+    float min_depth;
+    int pass;
+    uint32_t* target_buffer;
+    int fragments;
+    int tested_fragments;
+    int hiz_blocks_skipped;
+    int hiz_pixels_skipped;
+} triangle_setup_t;
+
+void set_micro_triangles(bool enabled);
+bool is_micro_triangles(void);
+
 vec3_t get_triangle_normal(vec4_t vertices[3]);
+float triangle_gradient_at(triangle_gradient_t gradient, vec4_t a, int x, int y);
+float triangle_row_reciprocal_w(const triangle_setup_t* setup, int y);
+
+// 1/w at pixel x of a row, from the row's value at x = 0. The span kernels,
+// their SIMD lanes and the Hi-Z tests all use these same float operations,
+// so a pixel gets the same depth wherever its span starts, and the shade
+// pass finds exactly the depth the depth pre-pass stored.
+static inline float triangle_reciprocal_w_at(float row_reciprocal_w, float reciprocal_w_dx, int x) {
+    return row_reciprocal_w + (float)x * reciprocal_w_dx;
+}
 void draw_triangle(int x0, int y0, int x1, int y1, int x2, int y2, uint32_t color);
 void draw_filled_triangle(
-    int x0, int y0, float z0, float w0,
-    int x1, int y1, float z1, float w1,
-    int x2, int y2, float z2, float w2,
-    uint32_t color
+    float x0, float y0, float z0, float w0,
+    float x1, float y1, float z1, float w1,
+    float x2, float y2, float z2, float w2,
+    uint32_t color, rect_t clip, int pass
 );
 void draw_textured_triangle(
-    int x0, int y0, float z0, float w0, float u0, float v0,
-    int x1, int y1, float z1, float w1, float u1, float v1,
-    int x2, int y2, float z2, float w2, float u2, float v2,
-    upng_t* texture
-);
-
-void draw_triangle_texel(int x, int y, upng_t *texture, 
-                vec4_t point_a, vec4_t point_b, vec4_t point_c,
-                tex2_t a_uv, tex2_t b_uv, tex2_t c_uv
+    float x0, float y0, float z0, float w0, float u0, float v0,
+    float x1, float y1, float z1, float w1, float u1, float v1,
+    float x2, float y2, float z2, float w2, float u2, float v2,
+    texture_t* texture, rect_t clip, int pass
 );
 
-void draw_triangle_pixel(int x, int y, uint32_t color, vec4_t point_a, vec4_t point_b, vec4_t point_c);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,492 @@
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <SDL2/SDL.h>
+#include "upng.h"
+#include "stats.h"
+#include "virtual_texture.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Virtual textures
+///////////////////////////////////////////////////////////////////////////////
+// A virtual texture never sits in memory as a whole. Its mip chain is baked
+// into a tile file next to the PNG (<png>.vtex): every level cut into 128x128
+// tiles, levels smaller than a tile padded to one. The header records the
+// size and modification time of the PNG, and the file is baked again when
+// they no longer match. At run time only
+// the levels that fit a single tile are kept resident; the other tiles share
+// one fixed-size cache:
+//
+//   - samplers stamp every tile they read with the current virtual frame, and
+//     read the same spot one level coarser when the tile is not resident.
+//     The single-tile levels always are, so the fallback always ends.
+//   - update_virtual_textures(), between frames, queues the tiles the last
+//     frame missed (coarse levels first) for a background loader thread, and
+//     moves the tiles the loader finished into the cache, evicting the least
+//     recently sampled ones.
+//
+// Tiles only change residency between frames, so the raster threads read
+// the page tables without locking. Several of them can stamp the same tile
+// at once, so last_used is atomic.
+///////////////////////////////////////////////////////////////////////////////
+
+#define VIRTUAL_FILE_MAGIC 0x32585456   // "VTX2"
+#define VIRTUAL_HEADER_SIZE 7
+#define VIRTUAL_TILE_BYTES (sizeof(uint32_t) * VIRTUAL_TILE_TEXELS)
+#define MAX_VIRTUAL_TEXTURES 64
+#define MAX_PENDING_TILES 32
+
+typedef struct {
+    virtual_texture_t* texture;
+    virtual_page_t* page;
+    long file_offset;
+    uint32_t* texels;   // Staging buffer the loader reads into
+    bool failed;
+    bool in_use;
+} tile_request_t;
+
+static bool virtual_texturing = false;
+static int virtual_frame = 0;
+
+static virtual_texture_t* open_textures[MAX_VIRTUAL_TEXTURES];
+static int num_open_textures = 0;
+
+// Tile cache
+static int cache_tiles = 0;
+static void* cache_allocation = NULL;
+static uint32_t* cache_texels = NULL;
+static virtual_page_t** cache_owners = NULL;
+static int resident_tiles = 0;
+
+// Loader thread and its queues
+static tile_request_t requests[MAX_PENDING_TILES];
+static int queued_requests[MAX_PENDING_TILES];
+static int queued_head = 0;
+static int queued_count = 0;
+static int loaded_requests[MAX_PENDING_TILES];
+static int loaded_count = 0;
+static int pending_tiles = 0;
+
+static SDL_Thread* loader_thread = NULL;
+static SDL_mutex* queue_mutex = NULL;
+static SDL_sem* requests_queued = NULL;
+static SDL_cond* tiles_loaded = NULL;     // Signaled with loaded_requests grown
+static bool is_loader_stopping = false;
+
+static int loader_loop(void* data) {
+    (void)data;
+    while (true) {
+        SDL_SemWait(requests_queued);
+        if (is_loader_stopping) {
+            break;
+        }
+        SDL_LockMutex(queue_mutex);
+        int request_index = queued_requests[queued_head];
+        queued_head = (queued_head + 1) % MAX_PENDING_TILES;
+        queued_count--;
+        SDL_UnlockMutex(queue_mutex);
+
+        tile_request_t* request = &requests[request_index];
+        FILE* file = request->texture->file;
+        request->failed = fseek(file, request->file_offset, SEEK_SET) != 0 ||
+            fread(request->texels, sizeof(uint32_t), VIRTUAL_TILE_TEXELS, file) != VIRTUAL_TILE_TEXELS;
+
+        SDL_LockMutex(queue_mutex);
+        loaded_requests[loaded_count++] = request_index;
+        SDL_CondSignal(tiles_loaded);
+        SDL_UnlockMutex(queue_mutex);
+    }
+    return 0;
+}
+
+// Allocate the shared tile cache and start the loader thread
+void init_virtual_texturing(int num_cache_tiles) {
+    cache_tiles = num_cache_tiles;
+    cache_allocation = malloc(VIRTUAL_TILE_BYTES * cache_tiles + 64);
+    cache_texels = (uint32_t*)(((uintptr_t)cache_allocation + 63) & ~(uintptr_t)63);
+    cache_owners = (virtual_page_t**)calloc(cache_tiles, sizeof(virtual_page_t*));
+    resident_tiles = 0;
+
+    for (int i = 0; i < MAX_PENDING_TILES; i++) {
+        requests[i].texels = (uint32_t*)malloc(VIRTUAL_TILE_BYTES);
+        requests[i].in_use = false;
+    }
+    queue_mutex = SDL_CreateMutex();
+    requests_queued = SDL_CreateSemaphore(0);
+    tiles_loaded = SDL_CreateCond();
+    is_loader_stopping = false;
+    loader_thread = SDL_CreateThread(loader_loop, "tile loader", NULL);
+    if (loader_thread == NULL) {
+        fprintf(stderr, "Error creating the virtual texture loader thread.\n");
+    }
+}
+
+// Stream the textures loaded from now on instead of keeping them in memory
+void set_virtual_texturing(bool enabled) {
+    virtual_texturing = enabled;
+}
+
+bool is_virtual_texturing(void) {
+    return virtual_texturing;
+}
+
+// Texel (x, y) of a virtual level, or of the finest resident level under it
+uint32_t fetch_virtual_texel(const texture_level_t* level, int x, int y) {
+    virtual_level_t* virtual_level = level->virtual_level;
+    while (true) {
+        virtual_page_t* page = &virtual_level->pages[((y >> VIRTUAL_TILE_SHIFT) << virtual_level->tiles_x_shift) + (x >> VIRTUAL_TILE_SHIFT)];
+        if (SDL_AtomicGet(&page->last_used) != virtual_frame) {
+            SDL_AtomicSet(&page->last_used, virtual_frame);
+        }
+        if (page->texels) {
+            return page->texels[((y & VIRTUAL_TILE_MASK) << VIRTUAL_TILE_SHIFT) + (x & VIRTUAL_TILE_MASK)];
+        }
+        virtual_level++;
+        x >>= 1;
+        y >>= 1;
+    }
+}
+
+// Tiles a side of a level dimension; small levels still take a whole tile
+static int level_tiles(int size) {
+    return size > VIRTUAL_TILE_SIZE ? size >> VIRTUAL_TILE_SHIFT : 1;
+}
+
+// Size and modification time of the source PNG, both -1 if it is missing
+static void get_png_stamp(const char* png_filename, int64_t* size, int64_t* mtime) {
+    struct stat png_stat;
+    if (stat(png_filename, &png_stat) != 0) {
+        *size = -1;
+        *mtime = -1;
+        return;
+    }
+    *size = (int64_t)png_stat.st_size;
+    *mtime = (int64_t)png_stat.st_mtime;
+}
+
+// Write every level of a loaded texture to a tile file
+static bool bake_tile_file(const texture_t* texture, const char* path, int64_t png_size, int64_t png_mtime) {
+    FILE* file = fopen(path, "wb");
+    if (file == NULL) {
+        return false;
+    }
+    int64_t header[VIRTUAL_HEADER_SIZE] = {
+        VIRTUAL_FILE_MAGIC, texture->levels[0].width, texture->levels[0].height, texture->num_levels, VIRTUAL_TILE_SHIFT,
+        png_size, png_mtime
+    };
+    fwrite(header, sizeof(int64_t), VIRTUAL_HEADER_SIZE, file);
+
+    uint32_t* tile = (uint32_t*)malloc(VIRTUAL_TILE_BYTES);
+    for (int i = 0; i < texture->num_levels; i++) {
+        const texture_level_t* level = &texture->levels[i];
+        for (int tile_y = 0; tile_y < level_tiles(level->height); tile_y++) {
+            for (int tile_x = 0; tile_x < level_tiles(level->width); tile_x++) {
+                for (int y = 0; y < VIRTUAL_TILE_SIZE; y++) {
+                    for (int x = 0; x < VIRTUAL_TILE_SIZE; x++) {
+                        int texel_x = tile_x * VIRTUAL_TILE_SIZE + x;
+                        int texel_y = tile_y * VIRTUAL_TILE_SIZE + y;
+                        bool inside = texel_x < level->width && texel_y < level->height;
+                        tile[y * VIRTUAL_TILE_SIZE + x] = inside ? fetch_texel(level, texel_x, texel_y) : 0;
+                    }
+                }
+                fwrite(tile, sizeof(uint32_t), VIRTUAL_TILE_TEXELS, file);
+            }
+        }
+    }
+    free(tile);
+    bool written = !ferror(file);
+    return fclose(file) == 0 && written;
+}
+
+// Read the header and the single-tile levels of a tile file. Files baked
+// from another version of the PNG are rejected, unless the PNG is gone.
+static texture_t* open_tile_file(const char* path, int64_t png_size, int64_t png_mtime) {
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        return NULL;
+    }
+    int64_t header[VIRTUAL_HEADER_SIZE];
+    if (fread(header, sizeof(int64_t), VIRTUAL_HEADER_SIZE, file) != VIRTUAL_HEADER_SIZE || header[0] != VIRTUAL_FILE_MAGIC ||
+        header[1] < 1 || header[2] < 1 || header[3] < 1 || header[3] > MAX_TEXTURE_LEVELS || header[4] != VIRTUAL_TILE_SHIFT ||
+        (png_size >= 0 && (header[5] != png_size || header[6] != png_mtime))) {
+        fclose(file);
+        return NULL;
+    }
+
+    virtual_texture_t* virtual_texture = (virtual_texture_t*)calloc(1, sizeof(virtual_texture_t));
+    texture_t* texture = (texture_t*)calloc(1, sizeof(texture_t));
+    virtual_texture->file = file;
+    virtual_texture->num_levels = (int)header[3];
+    texture->layout = TEXTURE_LAYOUT_TILED;
+    texture->format = TEXTURE_FORMAT_RGBA32;
+    texture->filter = TEXTURE_FILTER_GLOBAL;
+    texture->num_levels = (int)header[3];
+    texture->virtual_texture = virtual_texture;
+
+    int num_pinned = 0;
+    for (int i = 0, width = (int)header[1], height = (int)header[2]; i < texture->num_levels; i++) {
+        if (level_tiles(width) == 1 && level_tiles(height) == 1) num_pinned++;
+        width = width > 1 ? width / 2 : 1;
+        height = height > 1 ? height / 2 : 1;
+    }
+    virtual_texture->pinned_texels = (uint32_t*)malloc(VIRTUAL_TILE_BYTES * num_pinned);
+
+    bool complete = true;
+    long file_offset = sizeof(header);
+    uint32_t* pinned = virtual_texture->pinned_texels;
+    for (int i = 0, width = (int)header[1], height = (int)header[2]; i < texture->num_levels; i++) {
+        texture_level_t* level = &texture->levels[i];
+        virtual_level_t* virtual_level = &virtual_texture->levels[i];
+        level->width = width;
+        level->height = height;
+        level->width_mask = width - 1;
+        level->height_mask = height - 1;
+        level->tile_shift = VIRTUAL_TILE_SHIFT;
+        level->virtual_level = virtual_level;
+
+        int tiles_x = level_tiles(width);
+        while ((1 << virtual_level->tiles_x_shift) < tiles_x) virtual_level->tiles_x_shift++;
+        level->tile_stride_shift = virtual_level->tiles_x_shift;
+        virtual_level->num_tiles = tiles_x * level_tiles(height);
+        virtual_level->file_offset = file_offset;
+        virtual_level->pages = (virtual_page_t*)calloc(virtual_level->num_tiles, sizeof(virtual_page_t));
+        for (int p = 0; p < virtual_level->num_tiles; p++) {
+            SDL_AtomicSet(&virtual_level->pages[p].last_used, -1);
+            virtual_level->pages[p].slot = -1;
+        }
+
+        if (virtual_level->num_tiles == 1) {
+            complete = complete && fseek(file, file_offset, SEEK_SET) == 0 &&
+                fread(pinned, sizeof(uint32_t), VIRTUAL_TILE_TEXELS, file) == VIRTUAL_TILE_TEXELS;
+            virtual_level->pages[0].texels = pinned;
+            pinned += VIRTUAL_TILE_TEXELS;
+        }
+        file_offset += (long)VIRTUAL_TILE_BYTES * virtual_level->num_tiles;
+        width = width > 1 ? width / 2 : 1;
+        height = height > 1 ? height / 2 : 1;
+    }
+
+    if (!complete) {
+        free_virtual_texture(virtual_texture);
+        free(texture);
+        return NULL;
+    }
+    set_texture_addressing(texture, TEXTURE_ADDRESSING_WRAP);
+    return texture;
+}
+
+// Open the tile file of a PNG, baking it first from the PNG if needed
+texture_t* load_virtual_texture(const char* png_filename) {
+    if (num_open_textures == MAX_VIRTUAL_TEXTURES) {
+        fprintf(stderr, "Too many virtual textures.\n");
+        return NULL;
+    }
+    char* path = (char*)malloc(strlen(png_filename) + 6);
+    sprintf(path, "%s.vtex", png_filename);
+
+    int64_t png_size, png_mtime;
+    get_png_stamp(png_filename, &png_size, &png_mtime);
+    texture_t* texture = open_tile_file(path, png_size, png_mtime);
+    if (texture == NULL) {
+        // Baking needs the whole image once; later runs only read tiles
+        upng_t* png_image = upng_new_from_file(png_filename);
+        if (png_image != NULL) {
+            upng_decode(png_image);
+            if (upng_get_error(png_image) == UPNG_EOK) {
+                texture_t* baked = texture_from_png(png_image);
+                if (baked != NULL && !bake_tile_file(baked, path, png_size, png_mtime)) {
+                    fprintf(stderr, "Error writing the tile file %s.\n", path);
+                }
+                free_texture(baked);
+            }
+            upng_free(png_image);
+        }
+        texture = open_tile_file(path, png_size, png_mtime);
+    }
+    free(path);
+
+    if (texture != NULL) {
+        open_textures[num_open_textures++] = texture->virtual_texture;
+    }
+    return texture;
+}
+
+// Hand a missing tile to the loader
+static void queue_tile(virtual_texture_t* texture, virtual_level_t* level, int page_index) {
+    int request_index = 0;
+    while (requests[request_index].in_use) request_index++;
+
+    tile_request_t* request = &requests[request_index];
+    request->texture = texture;
+    request->page = &level->pages[page_index];
+    request->file_offset = level->file_offset + (long)VIRTUAL_TILE_BYTES * page_index;
+    request->in_use = true;
+    request->page->pending = true;
+    pending_tiles++;
+
+    SDL_LockMutex(queue_mutex);
+    queued_requests[(queued_head + queued_count) % MAX_PENDING_TILES] = request_index;
+    queued_count++;
+    SDL_UnlockMutex(queue_mutex);
+    SDL_SemPost(requests_queued);
+    add_stat(STAT_VIRTUAL_TILES_REQUESTED, 1);
+}
+
+// Copy a loaded tile into the least recently sampled cache slot
+static void install_tile(tile_request_t* request, int rendered_frame) {
+    virtual_page_t* page = request->page;
+    page->pending = false;
+    if (request->failed) {
+        // The tile is requested again the next time a frame misses it
+        fprintf(stderr, "Error reading the virtual texture tile at offset %ld.\n", request->file_offset);
+        return;
+    }
+
+    int victim = 0;
+    for (int slot = 0; slot < cache_tiles; slot++) {
+        if (cache_owners[slot] == NULL) {
+            victim = slot;
+            break;
+        }
+        if (SDL_AtomicGet(&cache_owners[slot]->last_used) < SDL_AtomicGet(&cache_owners[victim]->last_used)) {
+            victim = slot;
+        }
+    }
+    virtual_page_t* owner = cache_owners[victim];
+    if (owner != NULL) {
+        // Every cached tile was sampled last frame: the cache is smaller than
+        // the working set, keep what is there and ask again later
+        if (SDL_AtomicGet(&owner->last_used) >= rendered_frame) {
+            return;
+        }
+        owner->texels = NULL;
+        owner->slot = -1;
+        add_stat(STAT_VIRTUAL_TILES_EVICTED, 1);
+    } else {
+        resident_tiles++;
+    }
+
+    uint32_t* texels = cache_texels + (size_t)VIRTUAL_TILE_TEXELS * victim;
+    memcpy(texels, request->texels, VIRTUAL_TILE_BYTES);
+    page->texels = texels;
+    page->slot = victim;
+    cache_owners[victim] = page;
+    add_stat(STAT_VIRTUAL_TILES_LOADED, 1);
+}
+
+static void install_loaded_tiles(int rendered_frame) {
+    int loaded[MAX_PENDING_TILES];
+    SDL_LockMutex(queue_mutex);
+    int num_loaded = loaded_count;
+    memcpy(loaded, loaded_requests, sizeof(int) * num_loaded);
+    loaded_count = 0;
+    SDL_UnlockMutex(queue_mutex);
+
+    for (int i = 0; i < num_loaded; i++) {
+        install_tile(&requests[loaded[i]], rendered_frame);
+        requests[loaded[i]].in_use = false;
+        pending_tiles--;
+    }
+}
+
+// Between frames: cache the tiles that arrived and request the ones the
+// frame just rendered could not find
+void update_virtual_textures(void) {
+    if (num_open_textures == 0 || cache_tiles == 0) {
+        return;
+    }
+    int rendered_frame = virtual_frame;
+    install_loaded_tiles(rendered_frame);
+
+    // Only load as many tiles as there are slots the last frame did not need,
+    // or a cache smaller than the working set would reload tiles every frame
+    // just to drop them
+    int free_slots = 0;
+    for (int slot = 0; slot < cache_tiles; slot++) {
+        if (cache_owners[slot] == NULL || SDL_AtomicGet(&cache_owners[slot]->last_used) < rendered_frame) free_slots++;
+    }
+    int num_requests = free_slots - pending_tiles;
+    if (num_requests > MAX_PENDING_TILES - pending_tiles) num_requests = MAX_PENDING_TILES - pending_tiles;
+
+    for (int t = 0; t < num_open_textures && num_requests > 0; t++) {
+        virtual_texture_t* texture = open_textures[t];
+        for (int l = texture->num_levels - 1; l >= 0; l--) {
+            virtual_level_t* level = &texture->levels[l];
+            for (int p = 0; p < level->num_tiles; p++) {
+                virtual_page_t* page = &level->pages[p];
+                if (SDL_AtomicGet(&page->last_used) == rendered_frame && page->texels == NULL && !page->pending && num_requests > 0) {
+                    queue_tile(texture, level, p);
+                    num_requests--;
+                }
+            }
+        }
+    }
+    add_stat(STAT_VIRTUAL_TILES_RESIDENT, resident_tiles);
+    virtual_frame++;
+}
+
+void free_virtual_texture(virtual_texture_t* texture) {
+    if (texture == NULL) {
+        return;
+    }
+    // The loader may be reading this file: let the queued tiles land first.
+    // Each pending tile is either loaded already or still on its way.
+    while (pending_tiles > 0 && loader_thread != NULL) {
+        SDL_LockMutex(queue_mutex);
+        while (loaded_count == 0) {
+            SDL_CondWait(tiles_loaded, queue_mutex);
+        }
+        SDL_UnlockMutex(queue_mutex);
+        install_loaded_tiles(virtual_frame);
+    }
+
+    for (int t = 0; t < num_open_textures; t++) {
+        if (open_textures[t] == texture) {
+            open_textures[t] = open_textures[--num_open_textures];
+            break;
+        }
+    }
+    for (int l = 0; l < texture->num_levels; l++) {
+        virtual_level_t* level = &texture->levels[l];
+        for (int p = 0; p < level->num_tiles && level->pages; p++) {
+            if (level->pages[p].slot >= 0 && cache_owners != NULL) {
+                cache_owners[level->pages[p].slot] = NULL;
+                resident_tiles--;
+            }
+        }
+        free(level->pages);
+    }
+    free(texture->pinned_texels);
+    fclose(texture->file);
+    free(texture);
+}
+
+// Stop the loader and free the cache, after the virtual textures are freed
+void free_virtual_texturing(void) {
+    if (loader_thread != NULL) {
+        is_loader_stopping = true;
+        SDL_SemPost(requests_queued);
+        SDL_WaitThread(loader_thread, NULL);
+        loader_thread = NULL;
+    }
+    if (queue_mutex != NULL) {
+        SDL_DestroyMutex(queue_mutex);
+        SDL_DestroySemaphore(requests_queued);
+        SDL_DestroyCond(tiles_loaded);
+        queue_mutex = NULL;
+        requests_queued = NULL;
+        tiles_loaded = NULL;
+    }
+    for (int i = 0; i < MAX_PENDING_TILES; i++) {
+        free(requests[i].texels);
+        requests[i].texels = NULL;
+        requests[i].in_use = false;
+    }
+    free(cache_allocation);
+    free(cache_owners);
+    cache_allocation = NULL;
+    cache_texels = NULL;
+    cache_owners = NULL;
+    cache_tiles = 0;
+    pending_tiles = 0;
+}
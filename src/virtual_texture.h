@@ -0,0 +1,52 @@
+#ifndef VIRTUAL_TEXTURE_H
+#define VIRTUAL_TEXTURE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <SDL2/SDL.h>
+#include "texture.h"
+
+// Virtual textures are streamed in square tiles of 128x128 RGBA32 texels
+#define VIRTUAL_TILE_SHIFT 7
+#define VIRTUAL_TILE_SIZE (1 << VIRTUAL_TILE_SHIFT)
+#define VIRTUAL_TILE_MASK (VIRTUAL_TILE_SIZE - 1)
+#define VIRTUAL_TILE_TEXELS (VIRTUAL_TILE_SIZE * VIRTUAL_TILE_SIZE)
+
+// Default size of the shared tile cache: 256 tiles of 64 KiB, 16 MiB.
+// Installing a tile scans every slot for the least recently used one, so
+// that cost grows linearly with the cache size.
+#define VIRTUAL_CACHE_TILES 256
+
+// One tile of a virtual level
+typedef struct {
+    uint32_t* texels;       // NULL until the tile is resident
+    SDL_atomic_t last_used; // Last virtual frame that sampled the tile
+    int slot;               // Cache slot holding it, -1 if none
+    bool pending;           // Queued for the loader
+} virtual_page_t;
+
+typedef struct virtual_level {
+    virtual_page_t* pages;  // Row-major, one per tile
+    int tiles_x_shift;      // log2 of the tiles per row
+    int num_tiles;
+    long file_offset;       // Of the first tile in the tile file
+} virtual_level_t;
+
+typedef struct virtual_texture {
+    FILE* file;
+    int num_levels;
+    virtual_level_t levels[MAX_TEXTURE_LEVELS];
+    uint32_t* pinned_texels;    // Levels that fit a single tile, always resident
+} virtual_texture_t;
+
+void init_virtual_texturing(int cache_tiles);
+void set_virtual_texturing(bool enabled);
+bool is_virtual_texturing(void);
+
+texture_t* load_virtual_texture(const char* png_filename);
+void update_virtual_textures(void);
+void free_virtual_texture(virtual_texture_t* texture);
+void free_virtual_texturing(void);
+
+#endif
@@ -0,0 +1,144 @@
+#include <stdlib.h>
+#include <math.h>
+#include "stats.h"
+#include "visibility.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Visibility buffer (deferred texturing)
+///////////////////////////////////////////////////////////////////////////////
+// In this mode the rasterizer does no shading at all: every pixel that wins
+// the depth test stores the index (plus one) of its triangle in the
+// visibility buffer. The resolve pass then walks the pixels once, rebuilds
+// the perspective-correct barycentrics of the stored triangle at the pixel
+// center and samples the texture exactly once per pixel. Shading cost
+// depends on the screen size only, not on how many tiny triangles overlap.
+///////////////////////////////////////////////////////////////////////////////
+
+static uint32_t* visibility_buffer = NULL;
+static int buffer_width = 0;
+static bool visibility_rendering = false;
+
+// Per-triangle constants, rebuilt when the resolve walks onto a new triangle
+typedef struct {
+    float x[3];
+    float y[3];
+    float reciprocal_area;
+    float reciprocal_w[3];
+    float u_over_w[3];
+    float v_over_w[3];
+    const texture_level_t* texture_level;
+    bool bilinear;
+} resolve_triangle_t;
+
+void init_visibility_buffer(int width, int height) {
+    buffer_width = width;
+    visibility_buffer = (uint32_t*)malloc(sizeof(uint32_t) * width * height);
+}
+
+void set_visibility_rendering(bool enabled) {
+    visibility_rendering = enabled;
+}
+
+bool is_visibility_rendering(void) {
+    return visibility_rendering;
+}
+
+uint32_t* get_visibility_buffer(void) {
+    return visibility_buffer;
+}
+
+void clear_visibility_rect(rect_t rect) {
+    for (int y = rect.y_min; y < rect.y_max; y++) {
+        uint32_t* row = visibility_buffer + y * buffer_width;
+        for (int x = rect.x_min; x < rect.x_max; x++) {
+            row[x] = VISIBILITY_EMPTY;
+        }
+    }
+}
+
+static void setup_resolve_triangle(resolve_triangle_t* resolve, triangle_t* triangle) {
+    for (int i = 0; i < 3; i++) {
+        // Same sub-pixel snapping as the rasterizer
+        resolve->x[i] = (float)lrintf(triangle->points[i].x * SUBPIXEL_ONE) / SUBPIXEL_ONE;
+        resolve->y[i] = (float)lrintf(triangle->points[i].y * SUBPIXEL_ONE) / SUBPIXEL_ONE;
+
+        // Flip v like draw_textured_triangle() does
+        resolve->reciprocal_w[i] = 1 / triangle->points[i].w;
+        resolve->u_over_w[i] = triangle->texcoords[i].u * resolve->reciprocal_w[i];
+        resolve->v_over_w[i] = (1.0 - triangle->texcoords[i].v) * resolve->reciprocal_w[i];
+    }
+    float area = (resolve->x[1] - resolve->x[0]) * (resolve->y[2] - resolve->y[0]) -
+                 (resolve->x[2] - resolve->x[0]) * (resolve->y[1] - resolve->y[0]);
+    resolve->reciprocal_area = 1 / area;
+
+    // Same per-triangle mip level as draw_textured_triangle()
+    tex2_t* uv = triangle->texcoords;
+    float uv_area = fabsf((uv[1].u - uv[0].u) * (uv[2].v - uv[0].v) - (uv[2].u - uv[0].u) * (uv[1].v - uv[0].v));
+    int level = select_texture_level(triangle->texture, uv_area, fabsf(area));
+    resolve->texture_level = &triangle->texture->levels[level];
+    resolve->bilinear = get_texture_sample_filter(triangle->texture) == TEXTURE_FILTER_BILINEAR;
+}
+
+// Sample the texture of the triangle at the center of pixel (x, y)
+static uint32_t resolve_texel(const resolve_triangle_t* resolve, int x, int y) {
+    float px = x + 0.5f;
+    float py = y + 0.5f;
+
+    // Screen-space barycentric weights of the pixel center
+    float alpha = ((resolve->x[1] - px) * (resolve->y[2] - py) - (resolve->x[2] - px) * (resolve->y[1] - py)) * resolve->reciprocal_area;
+    float beta = ((resolve->x[2] - px) * (resolve->y[0] - py) - (resolve->x[0] - px) * (resolve->y[2] - py)) * resolve->reciprocal_area;
+    float gamma = 1 - alpha - beta;
+
+    // Interpolate u/w, v/w and 1/w linearly, then divide back by 1/w
+    float reciprocal_w = alpha * resolve->reciprocal_w[0] + beta * resolve->reciprocal_w[1] + gamma * resolve->reciprocal_w[2];
+    float u = (alpha * resolve->u_over_w[0] + beta * resolve->u_over_w[1] + gamma * resolve->u_over_w[2]) / reciprocal_w;
+    float v = (alpha * resolve->v_over_w[0] + beta * resolve->v_over_w[1] + gamma * resolve->v_over_w[2]) / reciprocal_w;
+
+    const texture_level_t* level = resolve->texture_level;
+    if (resolve->bilinear) {
+        return sample_texture_bilinear(level, u, v);
+    }
+    int tex_x = address_texel((int)floorf(u * level->width), level->min_texel, level->max_texel_x, level->width_mask);
+    int tex_y = address_texel((int)floorf(v * level->height), level->min_texel, level->max_texel_y, level->height_mask);
+    return fetch_texel(level, tex_x, tex_y);
+}
+
+// Shade every covered pixel of rect from the triangle stored under it
+void resolve_visibility_rect(triangle_t* triangles, rect_t rect) {
+    uint32_t* color_buffer = get_color_buffer();
+    bool textured = should_render_textured_triangles();
+
+    resolve_triangle_t resolve = { 0 };
+    uint32_t resolved_id = VISIBILITY_EMPTY;
+    int resolved_pixels = 0;
+
+    for (int y = rect.y_min; y < rect.y_max; y++) {
+        uint32_t* visibility_row = visibility_buffer + y * buffer_width;
+        uint32_t* color_row = color_buffer + y * buffer_width;
+        for (int x = rect.x_min; x < rect.x_max; x++) {
+            uint32_t id = visibility_row[x];
+            if (id == VISIBILITY_EMPTY) {
+                continue;
+            }
+            triangle_t* triangle = &triangles[id - 1];
+
+            if (!textured) {
+                color_row[x] = triangle->color;
+            } else {
+                // Neighbouring pixels mostly hit the same triangle
+                if (id != resolved_id) {
+                    setup_resolve_triangle(&resolve, triangle);
+                    resolved_id = id;
+                }
+                color_row[x] = resolve_texel(&resolve, x, y);
+            }
+            resolved_pixels++;
+        }
+    }
+    add_stat(STAT_SHADED_FRAGMENTS, resolved_pixels);
+}
+
+void free_visibility_buffer(void) {
+    free(visibility_buffer);
+    visibility_buffer = NULL;
+}
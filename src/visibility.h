@@ -0,0 +1,22 @@
+#ifndef VISIBILITY_H
+#define VISIBILITY_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "display.h"
+#include "triangle.h"
+
+// Visibility buffer value of pixels that no triangle covers
+#define VISIBILITY_EMPTY 0
+
+void init_visibility_buffer(int width, int height);
+void set_visibility_rendering(bool enabled);
+bool is_visibility_rendering(void);
+
+uint32_t* get_visibility_buffer(void);
+void clear_visibility_rect(rect_t rect);
+void resolve_visibility_rect(triangle_t* triangles, rect_t rect);
+
+void free_visibility_buffer(void);
+
+#endif